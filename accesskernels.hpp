@@ -0,0 +1,277 @@
+/*
+ * accesskernels.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	include <arm_neon.h>
+#	define ACCESS_HAVE_NEON 1
+#endif
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#	define ACCESS_HAVE_SSE2 1
+#endif
+
+/*
+ * Copy routines between device memory and a normal buffer. Each kernel
+ * uses one particular access width or instruction type, so one can find
+ * out which pattern the AXI bus and the IP behind it like best. "read"
+ * copies from the device into the buffer, "write" the other way around.
+ * The byte count is always a multiple of 4, the tail that does not fit
+ * the kernel's width is transferred in 32-bit words.
+ */
+typedef void (*AccessFunction)(void* dst, const void* src, size_t bytes);
+
+struct AccessKernel
+{
+	const char* name;
+	const char* description;
+	unsigned int alignment; /* Required alignment of the device address */
+	AccessFunction read;
+	AccessFunction write;
+};
+
+static inline void access_tail32(void* dst, const void* src, size_t bytes, size_t done)
+{
+	volatile uint32_t* d = (volatile uint32_t*)((char*)dst + done);
+	const volatile uint32_t* s = (const volatile uint32_t*)((const char*)src + done);
+	for (size_t n = (bytes - done) / sizeof(uint32_t); n != 0; --n)
+		*d++ = *s++;
+}
+
+template <class T> static void access_scalar(void* dst, const void* src, size_t bytes)
+{
+	volatile T* d = (volatile T*)dst;
+	const volatile T* s = (const volatile T*)src;
+	for (size_t n = bytes / sizeof(T); n != 0; --n)
+		*d++ = *s++;
+	access_tail32(dst, src, bytes, bytes & ~(sizeof(T)-1));
+}
+
+/* Eight loads in a row, then eight stores, so the bus sees back-to-back
+ * reads (or writes) that the interconnect may merge into a burst. */
+template <class T> static void access_burst(void* dst, const void* src, size_t bytes)
+{
+	volatile T* d = (volatile T*)dst;
+	const volatile T* s = (const volatile T*)src;
+	for (size_t n = bytes / (8 * sizeof(T)); n != 0; --n)
+	{
+		T v0 = s[0]; T v1 = s[1]; T v2 = s[2]; T v3 = s[3];
+		T v4 = s[4]; T v5 = s[5]; T v6 = s[6]; T v7 = s[7];
+		d[0] = v0; d[1] = v1; d[2] = v2; d[3] = v3;
+		d[4] = v4; d[5] = v5; d[6] = v6; d[7] = v7;
+		s += 8;
+		d += 8;
+	}
+	access_tail32(dst, src, bytes, bytes & ~(8*sizeof(T)-1));
+}
+
+static void access_memcpy(void* dst, const void* src, size_t bytes)
+{
+	memcpy(dst, src, bytes);
+}
+
+#ifdef ACCESS_HAVE_NEON
+static void access_neon(void* dst, const void* src, size_t bytes)
+{
+	uint32_t* d = (uint32_t*)dst;
+	const uint32_t* s = (const uint32_t*)src;
+	for (size_t n = bytes / 16; n != 0; --n)
+	{
+		vst1q_u32(d, vld1q_u32(s));
+		s += 4;
+		d += 4;
+	}
+	access_tail32(dst, src, bytes, bytes & ~15);
+}
+
+static void access_neon_burst(void* dst, const void* src, size_t bytes)
+{
+	uint32_t* d = (uint32_t*)dst;
+	const uint32_t* s = (const uint32_t*)src;
+	for (size_t n = bytes / 64; n != 0; --n)
+	{
+		uint32x4_t v0 = vld1q_u32(s);
+		uint32x4_t v1 = vld1q_u32(s + 4);
+		uint32x4_t v2 = vld1q_u32(s + 8);
+		uint32x4_t v3 = vld1q_u32(s + 12);
+		vst1q_u32(d, v0);
+		vst1q_u32(d + 4, v1);
+		vst1q_u32(d + 8, v2);
+		vst1q_u32(d + 12, v3);
+		s += 16;
+		d += 16;
+	}
+	access_tail32(dst, src, bytes, bytes & ~63);
+}
+#endif
+
+#ifdef __aarch64__
+/* Non-temporal pair store, hints the core not to allocate in cache */
+static void access_stnp_write(void* dst, const void* src, size_t bytes)
+{
+	char* d = (char*)dst;
+	const char* s = (const char*)src;
+	for (size_t n = bytes / 32; n != 0; --n)
+	{
+		__asm__ __volatile__(
+			"ldp q0, q1, [%1]\n\t"
+			"stnp q0, q1, [%0]\n\t"
+			: : "r" (d), "r" (s) : "v0", "v1", "memory");
+		s += 32;
+		d += 32;
+	}
+	access_tail32(dst, src, bytes, bytes & ~31);
+}
+
+static void access_ldnp_read(void* dst, const void* src, size_t bytes)
+{
+	char* d = (char*)dst;
+	const char* s = (const char*)src;
+	for (size_t n = bytes / 32; n != 0; --n)
+	{
+		__asm__ __volatile__(
+			"ldnp q0, q1, [%1]\n\t"
+			"stp q0, q1, [%0]\n\t"
+			: : "r" (d), "r" (s) : "v0", "v1", "memory");
+		s += 32;
+		d += 32;
+	}
+	access_tail32(dst, src, bytes, bytes & ~31);
+}
+#endif
+
+#ifdef ACCESS_HAVE_SSE2
+static void access_sse(void* dst, const void* src, size_t bytes)
+{
+	__m128i* d = (__m128i*)dst;
+	const __m128i* s = (const __m128i*)src;
+	for (size_t n = bytes / 16; n != 0; --n)
+		_mm_storeu_si128(d++, _mm_loadu_si128(s++));
+	access_tail32(dst, src, bytes, bytes & ~15);
+}
+
+static void access_sse_burst(void* dst, const void* src, size_t bytes)
+{
+	__m128i* d = (__m128i*)dst;
+	const __m128i* s = (const __m128i*)src;
+	for (size_t n = bytes / 64; n != 0; --n)
+	{
+		__m128i v0 = _mm_loadu_si128(s);
+		__m128i v1 = _mm_loadu_si128(s + 1);
+		__m128i v2 = _mm_loadu_si128(s + 2);
+		__m128i v3 = _mm_loadu_si128(s + 3);
+		_mm_storeu_si128(d, v0);
+		_mm_storeu_si128(d + 1, v1);
+		_mm_storeu_si128(d + 2, v2);
+		_mm_storeu_si128(d + 3, v3);
+		s += 4;
+		d += 4;
+	}
+	access_tail32(dst, src, bytes, bytes & ~63);
+}
+
+/* Streaming store, bypasses the cache. Needs 16-byte aligned target. */
+static void access_sse_nt_write(void* dst, const void* src, size_t bytes)
+{
+	__m128i* d = (__m128i*)dst;
+	const __m128i* s = (const __m128i*)src;
+	for (size_t n = bytes / 16; n != 0; --n)
+		_mm_stream_si128(d++, _mm_loadu_si128(s++));
+	_mm_sfence();
+	access_tail32(dst, src, bytes, bytes & ~15);
+}
+#endif
+
+static const AccessKernel access_kernels[] = {
+	{ "8", "8-bit loads/stores", 1, access_scalar<uint8_t>, access_scalar<uint8_t> },
+	{ "16", "16-bit loads/stores", 2, access_scalar<uint16_t>, access_scalar<uint16_t> },
+	{ "32", "32-bit loads/stores", 4, access_scalar<uint32_t>, access_scalar<uint32_t> },
+	{ "64", "64-bit loads/stores", 8, access_scalar<uint64_t>, access_scalar<uint64_t> },
+	{ "burst32", "32-bit, unrolled 8 deep", 4, access_burst<uint32_t>, access_burst<uint32_t> },
+	{ "burst64", "64-bit, unrolled 8 deep", 8, access_burst<uint64_t>, access_burst<uint64_t> },
+	{ "memcpy", "libc memcpy", 1, access_memcpy, access_memcpy },
+#ifdef ACCESS_HAVE_NEON
+	{ "neon", "128-bit NEON loads/stores", 16, access_neon, access_neon },
+	{ "neonburst", "128-bit NEON, unrolled 4 deep", 16, access_neon_burst, access_neon_burst },
+#endif
+#ifdef __aarch64__
+	{ "nt", "non-temporal LDNP/STNP pairs", 16, access_ldnp_read, access_stnp_write },
+#endif
+#ifdef ACCESS_HAVE_SSE2
+	{ "sse", "128-bit SSE loads/stores", 16, access_sse, access_sse },
+	{ "sseburst", "128-bit SSE, unrolled 4 deep", 16, access_sse_burst, access_sse_burst },
+	{ "nt", "128-bit SSE, non-temporal stores", 16, access_sse, access_sse_nt_write },
+#endif
+};
+
+static const unsigned int access_kernels_count =
+	sizeof(access_kernels) / sizeof(access_kernels[0]);
+
+/* Returns NULL when there is no kernel with that name on this platform */
+static inline const AccessKernel* find_access_kernel(const char* name)
+{
+	for (unsigned int i = 0; i < access_kernels_count; ++i)
+		if (strcmp(access_kernels[i].name, name) == 0)
+			return &access_kernels[i];
+	return NULL;
+}
+
+/* Offset of the first 32-bit word that differs between a and b, or
+ * 'bytes' when they are equal. Compares 16 bytes per step where the
+ * platform has vector instructions. */
+static inline size_t find_mismatch(const void* a, const void* b, size_t bytes)
+{
+	const uint32_t* wa = (const uint32_t*)a;
+	const uint32_t* wb = (const uint32_t*)b;
+	size_t done = 0;
+#if defined(ACCESS_HAVE_SSE2)
+	for (; done + 16 <= bytes; done += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)((const char*)a + done));
+		__m128i vb = _mm_loadu_si128((const __m128i*)((const char*)b + done));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xffff)
+			break;
+	}
+#elif defined(ACCESS_HAVE_NEON)
+	for (; done + 16 <= bytes; done += 16)
+	{
+		uint32x4_t eq = vceqq_u32(vld1q_u32(wa + done/4), vld1q_u32(wb + done/4));
+		uint32x2_t folded = vand_u32(vget_low_u32(eq), vget_high_u32(eq));
+		if ((vget_lane_u32(folded, 0) & vget_lane_u32(folded, 1)) != 0xffffffff)
+			break;
+	}
+#endif
+	for (size_t i = done / sizeof(uint32_t); i < bytes / sizeof(uint32_t); ++i)
+		if (wa[i] != wb[i])
+			return i * sizeof(uint32_t);
+	return bytes;
+}
@@ -0,0 +1,108 @@
+/*
+ * accesspatterns.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/*
+ * Order in which the 32-bit words of a region are visited. The offsets
+ * are computed up front, so the timed loop only does the bus accesses.
+ */
+enum AccessPatternType
+{
+	PATTERN_SEQUENTIAL,
+	PATTERN_STRIDED,
+	PATTERN_RANDOM
+};
+
+static const char* const access_pattern_names[] = {
+	"seq",
+	"stride",
+	"random",
+};
+
+static const unsigned int access_pattern_count =
+	sizeof(access_pattern_names) / sizeof(access_pattern_names[0]);
+
+/* Returns -1 when the name is not a pattern */
+static inline int find_access_pattern(const char* name)
+{
+	for (unsigned int i = 0; i < access_pattern_count; ++i)
+		if (strcmp(access_pattern_names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+/* Build word indices for a region of 'size' bytes. Strided visits every
+ * 'stride' bytes, then starts again one word further until all words
+ * have been visited. Random is a fixed-seed shuffle, so runs compare. */
+static inline void build_access_pattern(std::vector<uint32_t>& indices,
+	AccessPatternType type, size_t size, size_t stride)
+{
+	const uint32_t words = size / sizeof(uint32_t);
+	indices.resize(words);
+	switch (type)
+	{
+	case PATTERN_SEQUENTIAL:
+		for (uint32_t i = 0; i < words; ++i)
+			indices[i] = i;
+		break;
+	case PATTERN_STRIDED:
+		{
+			uint32_t step = stride / sizeof(uint32_t);
+			if (step == 0)
+				step = 1;
+			uint32_t n = 0;
+			for (uint32_t start = 0; start < step && start < words; ++start)
+				for (uint32_t i = start; i < words; i += step)
+					indices[n++] = i;
+		}
+		break;
+	case PATTERN_RANDOM:
+		{
+			uint32_t seed = 0x2545f491;
+			for (uint32_t i = 0; i < words; ++i)
+				indices[i] = i;
+			for (uint32_t i = words; i > 1; --i)
+			{
+				/* xorshift32 */
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				uint32_t j = seed % i;
+				uint32_t tmp = indices[i-1];
+				indices[i-1] = indices[j];
+				indices[j] = tmp;
+			}
+		}
+		break;
+	}
+}
@@ -0,0 +1,199 @@
+/*
+ * autotune.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AUTOTUNE_MIN_BLOCKSIZE 512
+#define AUTOTUNE_MAX_BLOCKSIZE (256*1024)
+/* Time to measure each size for */
+#define AUTOTUNE_INTERVAL_NS 250000000ULL
+/* A bigger size must be this much faster to be worth it */
+#define AUTOTUNE_GAIN 1.05
+/* Once settled, a throughput change this large starts a new search */
+#define AUTOTUNE_DRIFT 0.25
+
+enum AutotuneGoal
+{
+	AUTOTUNE_OFF,
+	AUTOTUNE_THROUGHPUT,
+	AUTOTUNE_LATENCY
+};
+
+/* Parses "throughput" or "latency=US", returns false if it is neither */
+static inline bool parse_autotune(const char* text, AutotuneGoal* goal, uint64_t* latency_ns)
+{
+	if (strcmp(text, "throughput") == 0)
+	{
+		*goal = AUTOTUNE_THROUGHPUT;
+		return true;
+	}
+	if (strncmp(text, "latency=", 8) != 0)
+		return false;
+	char* end;
+	unsigned long us = strtoul(text + 8, &end, 0);
+	if (end == text + 8 || *end || us == 0)
+		return false;
+	*goal = AUTOTUNE_LATENCY;
+	*latency_ns = us * 1000ULL;
+	return true;
+}
+
+/*
+ * Picks the transfer size for datraproxy while it runs. Each size gets
+ * measured for an interval. The tuner keeps doubling the size while
+ * that still buys throughput, and goes back to the best one when it
+ * no longer does. With a latency goal, a size whose latency is over
+ * the target does not count, and halving wins over everything else,
+ * unless halving did not lower the latency either.
+ * Once settled, a large change in throughput, or missing the latency
+ * target, starts the search again from where it is.
+ */
+class BlockSizeTuner
+{
+	AutotuneGoal goal;
+	uint64_t target_ns;
+	unsigned int min_size;
+	unsigned int max_size;
+	unsigned int ceiling; /* below the size that missed the latency target */
+	unsigned int granularity;
+	unsigned int best_size;
+	double best_rate;
+	double settled_rate;
+	uint64_t halved_at; /* latency that made the last halving, or 0 */
+	bool over_target;   /* settled without meeting the latency target */
+
+	unsigned int round(unsigned int n) const
+	{
+		n -= n % granularity;
+		if (n < min_size)
+			return min_size;
+		if (n > ceiling)
+			return ceiling;
+		return n;
+	}
+
+	bool move_to(unsigned int n)
+	{
+		n = round(n);
+		bool changed = (n != size);
+		size = n;
+		return changed;
+	}
+
+	bool settle(double rate, bool missed_target = false)
+	{
+		settled = true;
+		over_target = missed_target;
+		/* When that means a change, measure the new size first */
+		bool changed = move_to(best_size);
+		settled_rate = changed ? 0.0 : rate;
+		return changed;
+	}
+public:
+	unsigned int size;
+	bool settled;
+
+	/* Sizes are multiples of 'step', which must be at most min */
+	BlockSizeTuner(AutotuneGoal g, uint64_t latency_ns, unsigned int initial,
+			unsigned int min, unsigned int max, unsigned int step):
+		goal(g),
+		target_ns(latency_ns),
+		min_size(min - min % step),
+		max_size(max - max % step),
+		ceiling(max_size),
+		granularity(step),
+		best_size(0),
+		best_rate(0.0),
+		settled_rate(0.0),
+		halved_at(0),
+		over_target(false),
+		settled(false)
+	{
+		size = round(initial);
+	}
+
+	/* Feed one interval's throughput (bytes per second) and latency,
+	 * returns true when the size changed. */
+	bool update(double rate, uint64_t latency_ns)
+	{
+		if (rate <= 0.0)
+			return false; /* Idle, nothing learned */
+		bool too_slow = (goal == AUTOTUNE_LATENCY && latency_ns > target_ns);
+		if (settled)
+		{
+			if (settled_rate == 0.0)
+			{
+				settled_rate = rate;
+				return false;
+			}
+			if ((!too_slow || over_target) &&
+				rate > settled_rate * (1.0 - AUTOTUNE_DRIFT) &&
+				rate < settled_rate * (1.0 + AUTOTUNE_DRIFT))
+				return false;
+			settled = false;
+			best_size = 0;
+			if (!too_slow)
+				ceiling = max_size;
+		}
+		if (too_slow)
+		{
+			if (halved_at && latency_ns >= halved_at)
+			{
+				/* Smaller did not help, the latency comes from
+				 * elsewhere. Go back to the larger size. */
+				ceiling = max_size;
+				best_size = ceiling = round(size * 2);
+				halved_at = 0;
+				return settle(rate, true);
+			}
+			best_size = 0;
+			if (size <= min_size)
+			{
+				best_size = size;
+				return settle(rate, true);
+			}
+			ceiling = round(size / 2);
+			halved_at = latency_ns;
+			return move_to(size / 2);
+		}
+		halved_at = 0;
+		if (best_size == 0 || rate > best_rate * AUTOTUNE_GAIN)
+		{
+			best_size = size;
+			best_rate = rate;
+			if (size >= ceiling)
+				return settle(rate);
+			return move_to(size * 2);
+		}
+		/* Bigger did not help enough, stay with the best */
+		return settle(best_rate);
+	}
+};
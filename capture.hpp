@@ -0,0 +1,116 @@
+/*
+ * capture.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Register trace file, all fields in host byte order:
+ *   TraceHeader
+ *   uint32_t address[register_count]
+ *   records: uint64_t timestamp_ns; uint32_t value[register_count]
+ * Timestamps count from the start of the capture. With TRACE_FLAG_CHANGES
+ * only samples where at least one register changed are recorded (the
+ * first sample always is).
+ * Version 1 had a 32-bit period_ns in place of reserved and period_ns.
+ */
+#define TRACE_MAGIC 0x43525444 /* "DTRC" */
+#define TRACE_VERSION 2
+#define TRACE_FLAG_CHANGES 1
+
+struct TraceHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t register_count;
+	uint32_t flags;
+	int32_t node;
+	uint32_t reserved;  /* 0, keeps period_ns aligned */
+	uint64_t period_ns; /* 0 when sampling as fast as possible */
+};
+
+/*
+ * Single producer, single consumer ring of fixed size samples. The
+ * sampler never blocks: when the ring is full, the sample is dropped
+ * and counted. Capacity must be a power of two.
+ */
+class SampleRing
+{
+	std::vector<uint32_t> storage;
+	const unsigned int words_per_sample;
+	const uint32_t mask;
+	uint32_t head; /* written by producer */
+	uint32_t tail; /* written by consumer */
+public:
+	uint32_t dropped;
+
+	SampleRing(unsigned int capacity, unsigned int sample_words):
+		storage(capacity * sample_words),
+		words_per_sample(sample_words),
+		mask(capacity - 1),
+		head(0),
+		tail(0),
+		dropped(0)
+	{
+	}
+
+	/* Producer: slot to fill, or NULL when full */
+	uint32_t* reserve()
+	{
+		uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+		if (head - t > mask)
+		{
+			++dropped;
+			return NULL;
+		}
+		return &storage[(head & mask) * words_per_sample];
+	}
+
+	/* Producer: publish the slot returned by reserve() */
+	void commit()
+	{
+		__atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+	}
+
+	/* Consumer: contiguous run of available samples, count in *n */
+	const uint32_t* peek(unsigned int* n)
+	{
+		uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		uint32_t available = h - tail;
+		uint32_t until_wrap = (mask + 1) - (tail & mask);
+		*n = available < until_wrap ? available : until_wrap;
+		return &storage[(tail & mask) * words_per_sample];
+	}
+
+	/* Consumer: release n samples */
+	void consume(unsigned int n)
+	{
+		__atomic_store_n(&tail, tail + n, __ATOMIC_RELEASE);
+	}
+};
@@ -31,9 +31,22 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <errno.h>
 #include <iostream>
 #include <string.h>
-#include "benchmark.hpp"
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "metrics.hpp"
+#include "accesskernels.hpp"
+#include "accesspatterns.hpp"
+#include "mappingcache.hpp"
+#include "capture.hpp"
+#include "registerwait.hpp"
+#include "hexdump.hpp"
+#include "multicall.hpp"
 
 static void usage(const char* name)
 {
@@ -41,35 +54,1259 @@ static void usage(const char* name)
 		<< name << " [options] [-r] addr [addr..]\n"
 		<< name << " [options] -w addr value [value..]\n"
 		<< name << " [options] -b addr\n"
+		<< name << " [options] [-w] -H samples addr [value]\n"
+		<< name << " [options] [-w] -f script\n"
+		<< name << " [options] {-R|-X} -c count addr\n"
+		<< name << " [options] -w [-V] -L file addr\n"
+		<< name << " [options] -w -M [-S size] [-t threads] addr\n"
+		<< name << " [options] -W [-o ms] [-s us] addr mask value\n"
+		<< name << " [options] -T tracefile [-P us] [-D ms] [-C] addr [addr..]\n"
 		" -r    Read and display contents (default)\n"
 		" -w    Write to memory (dangerous)\n"
 		" -b    Benchmark mode (read addr continuously)\n"
+		" -f .. Run commands from script file ('-' for stdin), one per line:\n"
+		"         node N                   select node for next commands\n"
+		"         read addr [count]        display words\n"
+		"         write addr value [..]    write words (needs -w)\n"
+		"         poll addr mask value [ms] wait until (word & mask) == value\n"
+		"         compare addr value [mask] check word, fail if different\n"
+		"       Mappings are kept open and shared between commands.\n"
+		" -R    Dump count words at addr to stdout as raw binary\n"
+		" -X    Dump count words at addr to stdout in xxd format\n"
+		" -L .. Write contents of file to addr in large bursts (needs -w)\n"
+		" -V    Read back and compare after -L, exit status 2 on mismatch\n"
+		" -M    Memory test (destroys contents) of -S bytes at addr: walking ones,\n"
+		"       walking zeros, address-in-address and pseudo-random patterns.\n"
+		"       Uses -t threads, exit status 2 when errors were found.\n"
+		" -W    Wait until (word at addr & mask) == value, exit status 2 on timeout\n"
+		" -o #  Wait (and script poll) timeout in milliseconds (default 1000)\n"
+		" -s #  Wait spins this many microseconds before it starts to sleep\n"
+		"       (default 100)\n"
+		" -T .. Capture registers at addr(s) into a binary trace file ('-' for\n"
+		"       stdout) until the -D time has passed or interrupted.\n"
+		" -P #  Capture period in microseconds (default 0: as fast as possible)\n"
+		" -D #  Capture duration in milliseconds (default 0: until Ctrl-C)\n"
+		" -C    Capture only samples where a register changed\n"
+		" -H #  Time # single reads (or writes) and show latency percentiles\n"
 		"options:\n"
 		" -v    verbose mode.\n"
-		" -n #  Node (default is cfg, 0=cpu, >=1 hdl nodes)\n"
+		" -F .. Format of performance results: text (default), json or csv\n"
+		" -n #  Node (default is cfg, 0=cpu, >=1 hdl nodes). Benchmark accepts\n"
+		"       multiple nodes, threads are distributed over them.\n"
 		" -c #  Count - number of words to read at addres\n"
 		" -l    Long output\n"
 		" -d    Output in decimal\n"
+		" -t #  Benchmark with # threads, each on its own CPU and block\n"
+		" -k .. Access kernel for benchmark, 'all' to compare them, 'list' to show\n"
+		" -p .. Benchmark access pattern: seq, stride, random or all. Sweeps\n"
+		"       region sizes from 4k up to the -S size\n"
+		" -S #  Region size in bytes for -p and -M (default 64k, k and M suffixes)\n"
+		" -x #  Stride in bytes for the stride pattern (default 64)\n"
 		" addr  Offset in memory map\n"
 		" value Data to write (32-bit integer)\n";
 }
 
 #define PAGE_SIZE 4096
 
-int main(int argc, char** argv)
+/* All performance results go through this, see -F */
+static MetricsReporter report;
+
+static void list_access_kernels()
+{
+	for (unsigned int i = 0; i < access_kernels_count; ++i)
+		printf("%-10s %s\n", access_kernels[i].name, access_kernels[i].description);
+}
+
+struct BenchmarkResult
+{
+	unsigned int loops;
+	unsigned long long ops;
+	unsigned long long bytes;
+	uint64_t elapsed_us;
+};
+
+/* Run the kernel repeatedly for about a second. Returns false if the
+ * kernel cannot be used on this address. */
+static bool run_kernel(const AccessKernel* kernel, bool write,
+	volatile void* data, void* buffer, size_t blocksize, BenchmarkResult* result)
+{
+	if (((unsigned long)data) & (kernel->alignment - 1))
+		return false;
+	unsigned int repeats = (256u * 1024u) / blocksize;
+	if (repeats == 0)
+		repeats = 1;
+	unsigned int loops = 0;
+	Stopwatch timer;
+	timer.start();
+	do
+	{
+		if (write)
+			for (unsigned int repeat = repeats; repeat != 0; --repeat)
+				kernel->write((void*)data, buffer, blocksize);
+		else
+			for (unsigned int repeat = repeats; repeat != 0; --repeat)
+				kernel->read(buffer, (void*)data, blocksize);
+		++loops;
+		timer.stop();
+	} while (timer.elapsed_us() < 1000000);
+	result->loops = loops;
+	result->ops = (unsigned long long)loops * repeats;
+	result->bytes = result->ops * blocksize;
+	result->elapsed_us = timer.elapsed_us();
+	return true;
+}
+
+/*
+ * Lets worker threads start together. The creator holds the gate while
+ * it starts them, then open() lets them through with a barrier for all
+ * of them, or with 'abort' set when not all of them could be started.
+ * Only destroy it after joining every thread that was started.
+ */
+class StartGate
+{
+	StartGate(const StartGate&);
+	StartGate& operator=(const StartGate&);
+	pthread_mutex_t lock;
+	pthread_barrier_t barrier;
+	bool closed;
+	bool abort;
+public:
+	StartGate():
+		closed(true),
+		abort(false)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_mutex_lock(&lock);
+	}
+
+	~StartGate()
+	{
+		if (closed)
+			pthread_mutex_unlock(&lock);
+		else if (!abort)
+			pthread_barrier_destroy(&barrier);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/* All threads that will call wait() have been started, or with
+	 * all_started false, some could not be */
+	void open(unsigned int started, bool all_started)
+	{
+		abort = !all_started;
+		if (!abort)
+			pthread_barrier_init(&barrier, NULL, started);
+		closed = false;
+		pthread_mutex_unlock(&lock);
+	}
+
+	/* In each thread, returns false when it must not run at all */
+	bool wait()
+	{
+		pthread_mutex_lock(&lock);
+		pthread_mutex_unlock(&lock);
+		if (abort)
+			return false;
+		pthread_barrier_wait(&barrier);
+		return true;
+	}
+
+	/* Lines up all threads again, after wait() returned true */
+	void sync()
+	{
+		pthread_barrier_wait(&barrier);
+	}
+};
+
+struct BenchmarkThread
+{
+	pthread_t thread;
+	StartGate* gate;
+	int cpu;
+	int node;
+	volatile void* data;
+	std::vector<unsigned int> buffer;
+	const AccessKernel* kernel;
+	bool write;
+	bool ok;
+	BenchmarkResult result;
+};
+
+static void* benchmark_thread(void* arg)
+{
+	BenchmarkThread* t = (BenchmarkThread*)arg;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(t->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (!t->gate->wait())
+		return NULL;
+	t->ok = run_kernel(t->kernel, t->write, t->data, &t->buffer[0],
+		t->buffer.size() * sizeof(unsigned int), &t->result);
+	return NULL;
+}
+
+/* Owns the mappings of all nodes taking part in a benchmark */
+class BenchmarkMappings
+{
+public:
+	std::vector<datra::MemoryMap*> maps;
+	~BenchmarkMappings()
+	{
+		for (unsigned int i = 0; i < maps.size(); ++i)
+			delete maps[i];
+	}
+};
+
+static void report_result(const AccessKernel* kernel, const BenchmarkResult& r)
+{
+	MetricsRow row;
+	row.add("kernel", kernel->name)
+		.add("loops", r.loops)
+		.add("us", r.elapsed_us)
+		.add("bytes", r.bytes)
+		.add("MBps", r.bytes / r.elapsed_us);
+	report.emit(row);
+}
+
+static void report_skipped(const AccessKernel* kernel)
+{
+	MetricsRow row;
+	row.add("kernel", kernel->name)
+		.add("skipped_alignment", kernel->alignment);
+	report.emit(row);
+}
+
+static void benchmark_kernel(const AccessKernel* kernel, bool write,
+	std::vector<BenchmarkThread>& threads)
+{
+	if (threads.size() == 1)
+	{
+		BenchmarkThread& t = threads[0];
+		if (run_kernel(kernel, write, t.data, &t.buffer[0],
+				t.buffer.size() * sizeof(unsigned int), &t.result))
+			report_result(kernel, t.result);
+		else
+			report_skipped(kernel);
+		return;
+	}
+	StartGate gate;
+	unsigned int started;
+	for (started = 0; started < threads.size(); ++started)
+	{
+		threads[started].gate = &gate;
+		threads[started].kernel = kernel;
+		threads[started].write = write;
+		if (pthread_create(&threads[started].thread, NULL, benchmark_thread, &threads[started]) != 0)
+			break;
+	}
+	gate.open(started, started == threads.size());
+	for (unsigned int i = 0; i < started; ++i)
+		pthread_join(threads[i].thread, NULL);
+	if (started != threads.size())
+		throw std::runtime_error("Failed to create benchmark thread");
+	unsigned long long total_bytes = 0;
+	unsigned long long total_ops = 0;
+	uint64_t elapsed_us = 0;
+	for (unsigned int i = 0; i < threads.size(); ++i)
+	{
+		const BenchmarkThread& t = threads[i];
+		if (!t.ok)
+		{
+			report_skipped(kernel);
+			continue;
+		}
+		MetricsRow row;
+		row.add("kernel", kernel->name)
+			.add("thread", i)
+			.add("cpu", t.cpu)
+			.add("node", t.node)
+			.add("bytes", t.result.bytes)
+			.add("us", t.result.elapsed_us)
+			.add("MBps", t.result.bytes / t.result.elapsed_us)
+			.add("ns_per_op", (1000.0 * t.result.elapsed_us) / t.result.ops);
+		report.emit(row);
+		total_bytes += t.result.bytes;
+		total_ops += t.result.ops;
+		if (t.result.elapsed_us > elapsed_us)
+			elapsed_us = t.result.elapsed_us;
+	}
+	if (elapsed_us)
+	{
+		MetricsRow row;
+		row.add("kernel", kernel->name)
+			.add("threads", threads.size())
+			.add("bytes", total_bytes)
+			.add("us", elapsed_us)
+			.add("MBps", total_bytes / elapsed_us)
+			.add("ns_per_op", (1000.0 * elapsed_us * threads.size()) / total_ops);
+		report.emit(row);
+	}
+}
+
+/* Benchmark 'buffer' sized blocks at addr. With several threads, each
+ * one gets its own block. Threads are spread over the given nodes and
+ * take consecutive blocks within a node. */
+static void run_benchmark(datra::HardwareContext& ctrl, datra::File& file,
+	const std::vector<int>& nodes, int access, unsigned int n_threads,
+	unsigned int addr, const std::vector<unsigned int>& buffer,
+	const char* kernel_name, int verbose)
+{
+	const bool write = (access != O_RDONLY);
+	const size_t blocksize = buffer.size() * sizeof(unsigned int);
+	const unsigned int n_nodes = nodes.empty() ? 1 : nodes.size();
+	const unsigned int slots = (n_threads + n_nodes - 1) / n_nodes;
+	const off_t page_location = addr & ~(PAGE_SIZE-1);
+	const unsigned int page_offset = addr & (PAGE_SIZE-1);
+	const size_t size = page_offset + slots * blocksize;
+	const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	BenchmarkMappings mappings;
+	for (unsigned int i = 0; i < n_nodes && i < n_threads; ++i)
+	{
+		if (verbose) printf("Node %d: offset=%#x+%#x - %#zx (%zu)\n",
+			nodes.empty() ? -1 : nodes[i], (unsigned int)page_location,
+			page_offset, size, size);
+		if (i == 0)
+			mappings.maps.push_back(new datra::MemoryMap(file, page_location, size,
+				write ? PROT_READ|PROT_WRITE : PROT_READ));
+		else
+		{
+			/* The mapping remains valid after closing the file */
+			datra::File other(ctrl.openConfig(nodes[i], access));
+			mappings.maps.push_back(new datra::MemoryMap(other, page_location, size,
+				write ? PROT_READ|PROT_WRITE : PROT_READ));
+		}
+	}
+	std::vector<BenchmarkThread> threads(n_threads);
+	for (unsigned int i = 0; i < n_threads; ++i)
+	{
+		BenchmarkThread& t = threads[i];
+		t.cpu = n_cpus > 0 ? i % n_cpus : 0;
+		t.node = nodes.empty() ? -1 : nodes[i % n_nodes];
+		t.data = ((char*)mappings.maps[i % n_nodes]->memory) + page_offset + (i / n_nodes) * blocksize;
+		t.buffer = buffer;
+	}
+	if (strcmp(kernel_name, "all") == 0)
+	{
+		for (unsigned int i = 0; i < access_kernels_count; ++i)
+			benchmark_kernel(&access_kernels[i], write, threads);
+	}
+	else
+	{
+		const AccessKernel* kernel = find_access_kernel(kernel_name);
+		if (kernel == NULL)
+			throw std::runtime_error(std::string("Unknown access kernel: ") + kernel_name);
+		benchmark_kernel(kernel, write, threads);
+	}
+}
+
+static size_t parse_size(const char* txt)
+{
+	char* end;
+	size_t result = strtoul(txt, &end, 0);
+	switch (*end)
+	{
+	case 'k':
+	case 'K':
+		result <<= 10;
+		break;
+	case 'm':
+	case 'M':
+		result <<= 20;
+		break;
+	}
+	return result;
+}
+
+/* Visit the words in the order given by indices until the time is up.
+ * Returns the number of accesses done. */
+static unsigned long long run_pattern(volatile uint32_t* data,
+	const std::vector<uint32_t>& indices, bool write, uint64_t* elapsed_us)
+{
+	const uint32_t* idx = &indices[0];
+	const uint32_t n = indices.size();
+	unsigned long long accesses = 0;
+	uint32_t sum = 0;
+	Stopwatch timer;
+	timer.start();
+	do
+	{
+		if (write)
+			for (uint32_t i = 0; i < n; ++i)
+				data[idx[i]] = i;
+		else
+			for (uint32_t i = 0; i < n; ++i)
+				sum += data[idx[i]];
+		accesses += n;
+		timer.stop();
+	} while (timer.elapsed_us() < 250000);
+	*elapsed_us = timer.elapsed_us();
+	return accesses;
+}
+
+static void benchmark_patterns(datra::File& file, int access, unsigned int addr,
+	const char* pattern_name, size_t region, size_t stride, int verbose)
+{
+	const bool write = (access != O_RDONLY);
+	int first = 0;
+	int last = access_pattern_count - 1;
+	if (strcmp(pattern_name, "all") != 0)
+	{
+		first = last = find_access_pattern(pattern_name);
+		if (first < 0)
+			throw std::runtime_error(std::string("Unknown access pattern: ") + pattern_name);
+	}
+	region &= ~(sizeof(uint32_t)-1);
+	if (region == 0)
+		throw std::runtime_error("Region size too small");
+	off_t page_location = addr & ~(PAGE_SIZE-1);
+	unsigned int page_offset = addr & (PAGE_SIZE-1);
+	size_t size = page_offset + region;
+	if (verbose) printf("Addr: %#x (%d) offset=%#x+%#x - %#zx (%zu)\n",
+		addr, addr, (unsigned int)page_location, page_offset, size, size);
+	datra::MemoryMap mapping(file, page_location, size, write ? PROT_READ|PROT_WRITE : PROT_READ);
+	volatile uint32_t* data = (volatile uint32_t*)(((char*)mapping.memory) + page_offset);
+	std::vector<uint32_t> indices;
+	for (int pattern = first; pattern <= last; ++pattern)
+	{
+		size_t part = region < 4096 ? region : 4096;
+		for (;;)
+		{
+			build_access_pattern(indices, (AccessPatternType)pattern, part, stride);
+			uint64_t elapsed_us;
+			unsigned long long accesses = run_pattern(data, indices, write, &elapsed_us);
+			unsigned long long bytes = accesses * sizeof(uint32_t);
+			MetricsRow row;
+			row.add("pattern", access_pattern_names[pattern])
+				.add("region", part)
+				.add("stride", pattern == PATTERN_STRIDED ? stride : sizeof(uint32_t))
+				.add("accesses", accesses)
+				.add("us", elapsed_us)
+				.add("MBps", bytes / elapsed_us)
+				.add("ns_per_access", (1000.0 * elapsed_us) / accesses);
+			report.emit(row);
+			if (part == region)
+				break;
+			part <<= 1;
+			if (part > region)
+				part = region;
+		}
+	}
+}
+
+/* Time single accesses to one register. A write is followed by a
+ * barrier so it has to leave the CPU before the clock stops. */
+static void latency_histogram(datra::File& file, int access, unsigned int addr,
+	unsigned int value, unsigned int samples, int verbose)
+{
+	const bool write = (access != O_RDONLY);
+	off_t page_location = addr & ~(PAGE_SIZE-1);
+	unsigned int page_offset = addr & (PAGE_SIZE-1);
+	size_t size = page_offset + sizeof(unsigned int);
+	datra::MemoryMap mapping(file, page_location, size, write ? PROT_READ|PROT_WRITE : PROT_READ);
+	volatile unsigned int* data = (unsigned int*)(((char*)mapping.memory) + page_offset);
+	CycleTimer clock;
+	if (verbose)
+		printf("Timer: %.3f ns/cycle, overhead %llu cycles\n",
+			clock.ns_per_cycle, (unsigned long long)clock.overhead);
+	Histogram histogram;
+	unsigned int dummy = 0;
+	for (unsigned int i = 0; i < samples; ++i)
+	{
+		uint64_t start;
+		uint64_t stop;
+		if (write)
+		{
+			start = read_cycles();
+			*data = value;
+			__sync_synchronize();
+			stop = read_cycles();
+		}
+		else
+		{
+			start = read_cycles();
+			dummy += *data;
+			stop = read_cycles();
+		}
+		histogram.record(clock.to_ns(stop - start));
+	}
+	MetricsRow row;
+	row.add("access", write ? "write" : "read")
+		.add("latency_ns", histogram);
+	report.emit(row);
+	if (verbose)
+	{
+		for (unsigned int i = 0; i < histogram.buckets.size(); ++i)
+			if (histogram.buckets[i])
+				printf("<=%8llu ns: %llu\n",
+					(unsigned long long)Histogram::highest(i),
+					(unsigned long long)histogram.buckets[i]);
+	}
+}
+
+static const char* const script_separators = " \t\r\n";
+
+static unsigned int script_argument(const char* command, int line_number)
+{
+	const char* arg = strtok(NULL, script_separators);
+	if (arg == NULL)
+	{
+		char msg[128];
+		snprintf(msg, sizeof(msg), "line %d: too few arguments for %s", line_number, command);
+		throw std::runtime_error(msg);
+	}
+	return strtoul(arg, NULL, 0);
+}
+
+/* Returns the number of failed poll and compare commands */
+static unsigned int run_script(datra::HardwareContext& ctrl, FILE* input,
+	int access, int node, const char* short_format,
+	unsigned int default_timeout_ms, unsigned int spin_us, int verbose)
+{
+	MappingCache cache(ctrl, access);
+	unsigned int failures = 0;
+	int line_number = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), input) != NULL)
+	{
+		++line_number;
+		char* comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+		const char* command = strtok(line, script_separators);
+		if (command == NULL)
+			continue;
+		if (strcmp(command, "node") == 0)
+		{
+			const char* arg = strtok(NULL, script_separators);
+			node = arg ? strtol(arg, NULL, 0) : -1;
+		}
+		else if (strcmp(command, "read") == 0)
+		{
+			unsigned int addr = script_argument(command, line_number);
+			const char* arg = strtok(NULL, script_separators);
+			unsigned int count = arg ? strtoul(arg, NULL, 0) : 1;
+			volatile unsigned int* data = (volatile unsigned int*)
+				cache.get(node, addr, count * sizeof(unsigned int));
+			for (unsigned int i = 0; i < count; i += 4)
+			{
+				printf("@0x%04x: ", (unsigned int)(addr + (i*sizeof(unsigned int))));
+				for (unsigned int j = i; j < count && j < i+4; ++j)
+					printf(short_format, data[j]);
+				printf("\n");
+			}
+		}
+		else if (strcmp(command, "write") == 0)
+		{
+			if (access == O_RDONLY)
+				throw std::runtime_error("Script contains write, use -w to allow it");
+			unsigned int addr = script_argument(command, line_number);
+			std::vector<unsigned int> values;
+			for (const char* arg = strtok(NULL, script_separators); arg; arg = strtok(NULL, script_separators))
+				values.push_back(strtoul(arg, NULL, 0));
+			if (values.empty())
+				script_argument(command, line_number);
+			volatile unsigned int* data = (volatile unsigned int*)
+				cache.get(node, addr, values.size() * sizeof(unsigned int));
+			for (unsigned int i = 0; i < values.size(); ++i)
+				data[i] = values[i];
+		}
+		else if (strcmp(command, "poll") == 0)
+		{
+			unsigned int addr = script_argument(command, line_number);
+			unsigned int mask = script_argument(command, line_number);
+			unsigned int value = script_argument(command, line_number);
+			const char* arg = strtok(NULL, script_separators);
+			unsigned int timeout_ms = arg ? strtoul(arg, NULL, 0) : default_timeout_ms;
+			volatile unsigned int* data = (volatile unsigned int*)
+				cache.get(node, addr, sizeof(unsigned int));
+			RegisterWaitResult r = wait_register(data, mask, value, timeout_ms * 1000ULL, spin_us);
+			if (!r.success)
+			{
+				printf("line %d: poll @0x%04x timeout, %#x & %#x != %#x\n",
+					line_number, addr, r.value, mask, value);
+				++failures;
+			}
+			else if (verbose)
+				printf("line %d: poll @0x%04x done after %llu us, %u polls\n",
+					line_number, addr, (unsigned long long)r.elapsed_us, r.polls);
+		}
+		else if (strcmp(command, "compare") == 0)
+		{
+			unsigned int addr = script_argument(command, line_number);
+			unsigned int value = script_argument(command, line_number);
+			const char* arg = strtok(NULL, script_separators);
+			unsigned int mask = arg ? strtoul(arg, NULL, 0) : ~0u;
+			volatile unsigned int* data = (volatile unsigned int*)
+				cache.get(node, addr, sizeof(unsigned int));
+			unsigned int current = *data;
+			if ((current & mask) != (value & mask))
+			{
+				printf("line %d: compare @0x%04x failed, %#x & %#x != %#x\n",
+					line_number, addr, current, mask, value);
+				++failures;
+			}
+		}
+		else
+		{
+			char msg[128];
+			snprintf(msg, sizeof(msg), "line %d: unknown command '%s'", line_number, command);
+			throw std::runtime_error(msg);
+		}
+		/* No command keeps a pointer into the mappings */
+		cache.release();
+	}
+	if (verbose)
+		printf("Script done: %d lines, %u failed, mappings %u reused %u created\n",
+			line_number, failures, cache.hits, cache.misses);
+	return failures;
+}
+
+static volatile sig_atomic_t capture_stop = 0;
+
+static void capture_signal(int)
+{
+	capture_stop = 1;
+}
+
+struct CaptureWriter
+{
+	pthread_t thread;
+	SampleRing* ring;
+	FILE* output;
+	unsigned int register_count;
+	double ns_per_cycle;
+	uint64_t start;
+	int done; /* Set by the sampler when it has committed its last sample */
+	unsigned long long written;
+	bool failed;
+};
+
+/* Drains the ring into the output file, converting the timestamps */
+static void* capture_writer(void* arg)
+{
+	CaptureWriter* w = (CaptureWriter*)arg;
+	const unsigned int words = 2 + w->register_count;
+	for (;;)
+	{
+		bool done = __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+		unsigned int n;
+		const uint32_t* samples = w->ring->peek(&n);
+		if (n == 0)
+		{
+			if (done)
+				break;
+			usleep(1000);
+			continue;
+		}
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			const uint32_t* sample = samples + i * words;
+			uint64_t cycles;
+			memcpy(&cycles, sample, sizeof(cycles));
+			uint64_t timestamp = (uint64_t)((cycles - w->start) * w->ns_per_cycle);
+			if (fwrite(&timestamp, sizeof(timestamp), 1, w->output) != 1 ||
+				fwrite(sample + 2, sizeof(uint32_t), w->register_count, w->output) != w->register_count)
+				w->failed = true;
+		}
+		w->ring->consume(n);
+		w->written += n;
+	}
+	return NULL;
+}
+
+static void capture(datra::HardwareContext& ctrl, int node, const char* filename,
+	const std::vector<unsigned int>& addresses, unsigned int period_us,
+	unsigned int duration_ms, bool changes_only, int verbose)
+{
+	const unsigned int n = addresses.size();
+	MappingCache cache(ctrl, O_RDONLY);
+	std::vector<volatile uint32_t*> registers(n);
+	for (unsigned int i = 0; i < n; ++i)
+		registers[i] = (volatile uint32_t*)cache.get(node, addresses[i], sizeof(uint32_t));
+	FILE* output = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "wb");
+	if (output == NULL)
+		throw datra::IOException(filename);
+	setvbuf(output, NULL, _IOFBF, 256 * 1024);
+	TraceHeader header;
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.register_count = n;
+	header.flags = changes_only ? TRACE_FLAG_CHANGES : 0;
+	header.node = node;
+	header.reserved = 0;
+	header.period_ns = period_us * 1000ULL;
+	bool header_ok = (fwrite(&header, sizeof(header), 1, output) == 1);
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		uint32_t address = addresses[i];
+		if (fwrite(&address, sizeof(address), 1, output) != 1)
+			header_ok = false;
+	}
+	if (!header_ok)
+	{
+		if (output != stdout)
+			fclose(output);
+		throw datra::IOException(filename);
+	}
+
+	CycleTimer clock;
+	SampleRing ring(64 * 1024, 2 + n);
+	CaptureWriter writer;
+	writer.ring = &ring;
+	writer.output = output;
+	writer.register_count = n;
+	writer.ns_per_cycle = clock.ns_per_cycle;
+	writer.done = 0;
+	writer.written = 0;
+	writer.failed = false;
+	signal(SIGINT, capture_signal);
+	signal(SIGTERM, capture_signal);
+	writer.start = read_cycles();
+	if (pthread_create(&writer.thread, NULL, capture_writer, &writer) != 0)
+	{
+		if (output != stdout)
+			fclose(output);
+		throw std::runtime_error("Failed to create writer thread");
+	}
+
+	const uint64_t period = (uint64_t)(period_us * 1000.0 / clock.ns_per_cycle);
+	const uint64_t end = writer.start + (uint64_t)(duration_ms * 1000000.0 / clock.ns_per_cycle);
+	std::vector<uint32_t> previous(n);
+	unsigned long long samples = 0;
+	uint64_t next = writer.start;
+	uint64_t now = writer.start;
+	int sleep_error = 0;
+	while (!capture_stop)
+	{
+		if (period)
+		{
+			int64_t remaining_ns = (int64_t)((int64_t)(next - read_cycles()) * clock.ns_per_cycle);
+			if (remaining_ns > 200000)
+			{
+				/* Sleep most of the way, spin for the last bit */
+				int64_t sleep_ns = remaining_ns - 100000;
+				struct timespec pause;
+				pause.tv_sec = sleep_ns / 1000000000;
+				pause.tv_nsec = sleep_ns % 1000000000;
+				/* EINTR is the stop signal, the loop checks for it */
+				if (nanosleep(&pause, NULL) != 0 && errno != EINTR)
+				{
+					sleep_error = errno;
+					break;
+				}
+			}
+			while ((int64_t)(next - read_cycles()) > 0)
+				;
+			next += period;
+		}
+		now = read_cycles();
+		if (duration_ms && (int64_t)(now - end) >= 0)
+			break;
+		if (period && (int64_t)(now - next) > 0)
+			next = now; /* Fell behind, don't try to catch up */
+		uint32_t* slot = ring.reserve();
+		if (slot == NULL)
+			continue;
+		uint32_t* values = slot + 2;
+		for (unsigned int i = 0; i < n; ++i)
+			values[i] = registers[i][0];
+		if (changes_only && samples &&
+				memcmp(values, &previous[0], n * sizeof(uint32_t)) == 0)
+			continue;
+		memcpy(slot, &now, sizeof(now));
+		ring.commit();
+		if (changes_only)
+			memcpy(&previous[0], values, n * sizeof(uint32_t));
+		++samples;
+	}
+	__atomic_store_n(&writer.done, 1, __ATOMIC_RELEASE);
+	pthread_join(writer.thread, NULL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	if (output != stdout)
+		fclose(output);
+	else
+		fflush(output);
+	if (writer.failed)
+		throw datra::IOException(filename);
+	if (sleep_error)
+		throw datra::IOException(sleep_error);
+	if (verbose)
+	{
+		double elapsed_us = (now - writer.start) * clock.ns_per_cycle / 1000.0;
+		fprintf(stderr, "Captured %llu samples in %.0f us (%.0f samples/s), %u dropped\n",
+			samples, elapsed_us, elapsed_us > 0 ? samples * 1000000.0 / elapsed_us : 0.0,
+			ring.dropped);
+	}
+	else if (ring.dropped)
+		fprintf(stderr, "Capture dropped %u samples, writer too slow\n", ring.dropped);
+}
+
+static void write_all(int fd, const void* data, size_t size)
+{
+	const char* d = (const char*)data;
+	while (size)
+	{
+		ssize_t bytes = ::write(fd, d, size);
+		if (bytes <= 0)
+		{
+			if (bytes == 0)
+				throw datra::EndOfOutputException();
+			if (errno != EINTR)
+				throw datra::IOException("stdout");
+			continue;
+		}
+		d += bytes;
+		size -= bytes;
+	}
+}
+
+/* The widest unrolled kernel this platform has */
+static const AccessKernel* default_bulk_kernel()
+{
+	static const char* const preferred[] = { "neonburst", "sseburst", "burst64" };
+	for (unsigned int i = 0; i < sizeof(preferred)/sizeof(preferred[0]); ++i)
+	{
+		const AccessKernel* kernel = find_access_kernel(preferred[i]);
+		if (kernel)
+			return kernel;
+	}
+	return find_access_kernel("32");
+}
+
+/* Copy out the region in large chunks using burst reads, and write it
+ * raw or hex formatted with as few write calls as possible. */
+static void bulk_dump(datra::File& file, unsigned int addr, unsigned int count,
+	bool raw, const char* kernel_name, int verbose)
+{
+	const size_t chunk_size = 64 * 1024;
+	const size_t total = (size_t)count * sizeof(unsigned int);
+	const AccessKernel* kernel = kernel_name ? find_access_kernel(kernel_name) : default_bulk_kernel();
+	if (kernel == NULL)
+		throw std::runtime_error(std::string("Unknown access kernel: ") + kernel_name);
+	if (addr & (kernel->alignment - 1))
+		kernel = find_access_kernel("32");
+	off_t page_location = addr & ~(PAGE_SIZE-1);
+	unsigned int page_offset = addr & (PAGE_SIZE-1);
+	size_t size = page_offset + total;
+	if (verbose) fprintf(stderr, "Addr: %#x (%d) offset=%#x+%#x - %#zx (%zu) kernel %s\n",
+		addr, addr, (unsigned int)page_location, page_offset, size, size, kernel->name);
+	datra::MemoryMap mapping(file, page_location, size, PROT_READ);
+	const char* data = ((const char*)mapping.memory) + page_offset;
+	void* buffer;
+	if (posix_memalign(&buffer, 64, chunk_size) != 0)
+		throw std::bad_alloc();
+	std::vector<char> text(raw ? 0 : (chunk_size / 16) * HEXDUMP_LINE_SIZE);
+	HexFormatter formatter;
+	Stopwatch timer;
+	timer.start();
+	try
+	{
+		for (size_t pos = 0; pos < total; pos += chunk_size)
+		{
+			size_t n = total - pos < chunk_size ? total - pos : chunk_size;
+			kernel->read(buffer, data + pos, n);
+			if (raw)
+				write_all(1, buffer, n);
+			else
+				write_all(1, &text[0], formatter.format(&text[0], (const uint8_t*)buffer, n, addr + pos));
+		}
+	}
+	catch (...)
+	{
+		free(buffer);
+		throw;
+	}
+	free(buffer);
+	timer.stop();
+	if (verbose)
+	{
+		uint64_t elapsed_us = timer.elapsed_us();
+		fprintf(stderr, "Dumped %zu bytes in %llu us (%llu MB/s)\n",
+			total, (unsigned long long)elapsed_us,
+			(unsigned long long)(elapsed_us ? total / elapsed_us : 0));
+	}
+}
+
+/* Stream a file into the mapped region. Returns the number of words
+ * that did not read back correctly (always 0 without verify). */
+static unsigned int bulk_load(datra::File& file, unsigned int addr, const char* filename,
+	size_t max_size, bool verify, const char* kernel_name, int verbose)
+{
+	const size_t chunk_size = 1024 * 1024;
+	datra::File input(filename, O_RDONLY);
+	struct stat st;
+	if (fstat(input, &st) != 0)
+		throw datra::IOException(filename);
+	size_t total = S_ISREG(st.st_mode) ? st.st_size : max_size;
+	if (total == 0)
+		throw std::runtime_error("Nothing to load, use -c for the size of a non-regular file");
+	const size_t padded_total = (total + 3) & ~(size_t)3;
+	const AccessKernel* kernel = kernel_name ? find_access_kernel(kernel_name) : default_bulk_kernel();
+	if (kernel == NULL)
+		throw std::runtime_error(std::string("Unknown access kernel: ") + kernel_name);
+	if (addr & (kernel->alignment - 1))
+		kernel = find_access_kernel("32");
+	off_t page_location = addr & ~(PAGE_SIZE-1);
+	unsigned int page_offset = addr & (PAGE_SIZE-1);
+	size_t size = page_offset + padded_total;
+	if (verbose) fprintf(stderr, "Addr: %#x (%d) offset=%#x+%#x - %#zx (%zu) kernel %s\n",
+		addr, addr, (unsigned int)page_location, page_offset, size, size, kernel->name);
+	datra::MemoryMap mapping(file, page_location, size, PROT_READ|PROT_WRITE);
+	char* data = ((char*)mapping.memory) + page_offset;
+	void* buffer;
+	if (posix_memalign(&buffer, 64, 2 * chunk_size) != 0)
+		throw std::bad_alloc();
+	char* source = (char*)buffer;
+	char* readback = source + chunk_size;
+	uint64_t write_us = 0;
+	uint64_t verify_us = 0;
+	unsigned int mismatches = 0;
+	size_t pos = 0;
+	try
+	{
+		Stopwatch timer;
+		while (pos < total)
+		{
+			size_t n = total - pos < chunk_size ? total - pos : chunk_size;
+			size_t got = 0;
+			while (got < n)
+			{
+				ssize_t bytes = ::read(input, source + got, n - got);
+				if (bytes < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					throw datra::IOException(filename);
+				}
+				if (bytes == 0)
+					break;
+				got += bytes;
+			}
+			if (got == 0)
+				break;
+			n = (got + 3) & ~(size_t)3;
+			if (n != got)
+			{
+				/* Keep the bytes of the last word that the file doesn't cover */
+				uint32_t last = *(volatile uint32_t*)(data + pos + n - 4);
+				memcpy(source + got, ((char*)&last) + 4 - (n - got), n - got);
+			}
+			timer.start();
+			kernel->write(data + pos, source, n);
+			timer.stop();
+			write_us += timer.elapsed_us();
+			if (verify)
+			{
+				timer.start();
+				kernel->read(readback, data + pos, n);
+				for (size_t offset = 0; offset < n; offset += 4)
+				{
+					offset += find_mismatch(source + offset, readback + offset, n - offset);
+					if (offset >= n)
+						break;
+					if (mismatches < 10)
+						fprintf(stderr, "Mismatch @0x%04x: expected %#x actual %#x\n",
+							(unsigned int)(addr + pos + offset),
+							*(uint32_t*)(source + offset), *(uint32_t*)(readback + offset));
+					++mismatches;
+				}
+				timer.stop();
+				verify_us += timer.elapsed_us();
+			}
+			pos += n;
+		}
+	}
+	catch (...)
+	{
+		free(buffer);
+		throw;
+	}
+	free(buffer);
+	MetricsRow row;
+	row.add("bytes", pos)
+		.add("write_us", write_us)
+		.add("write_MBps", write_us ? pos / write_us : 0);
+	if (verify)
+		row.add("verify_us", verify_us)
+			.add("verify_MBps", verify_us ? pos / verify_us : 0)
+			.add("mismatches", mismatches);
+	report.emit(row);
+	return mismatches;
+}
+
+enum MemtestPattern
+{
+	MEMTEST_WALKING_ONES,
+	MEMTEST_WALKING_ZEROS,
+	MEMTEST_ADDRESS,
+	MEMTEST_RANDOM,
+	MEMTEST_PATTERNS
+};
+
+static const char* const memtest_pattern_names[MEMTEST_PATTERNS] = {
+	"ones",
+	"zeros",
+	"address",
+	"random",
+};
+
+/* Pattern value for the word at 'address'. A pure function of the
+ * address, so the verify pass can regenerate what was written. */
+static void memtest_fill(uint32_t* buffer, MemtestPattern pattern,
+	uint32_t address, size_t words)
+{
+	switch (pattern)
+	{
+	case MEMTEST_WALKING_ONES:
+		for (size_t i = 0; i < words; ++i, address += 4)
+			buffer[i] = 1u << ((address >> 2) & 31);
+		break;
+	case MEMTEST_WALKING_ZEROS:
+		for (size_t i = 0; i < words; ++i, address += 4)
+			buffer[i] = ~(1u << ((address >> 2) & 31));
+		break;
+	case MEMTEST_ADDRESS:
+		for (size_t i = 0; i < words; ++i, address += 4)
+			buffer[i] = address;
+		break;
+	default:
+		for (size_t i = 0; i < words; ++i, address += 4)
+		{
+			/* Integer hash (lowbias32) */
+			uint32_t x = address ^ 0x9e3779b9;
+			x ^= x >> 16;
+			x *= 0x7feb352d;
+			x ^= x >> 15;
+			x *= 0x846ca68b;
+			x ^= x >> 16;
+			buffer[i] = x;
+		}
+		break;
+	}
+}
+
+struct MemtestError
+{
+	uint32_t address;
+	uint32_t expected;
+	uint32_t actual;
+};
+
+#define MEMTEST_MAX_REPORTED 16
+
+struct MemtestThread
+{
+	pthread_t thread;
+	StartGate* gate;
+	int cpu;
+	char* data;
+	uint32_t address; /* Device address of data */
+	size_t bytes;
+	const AccessKernel* kernel;
+	uint64_t write_us[MEMTEST_PATTERNS];
+	uint64_t verify_us[MEMTEST_PATTERNS];
+	unsigned int errors[MEMTEST_PATTERNS];
+	std::vector<MemtestError> reported;
+	bool no_memory; /* could not test, its buffer did not allocate */
+};
+
+/* Each pattern is written to the whole region by all threads before any
+ * of them reads back, so a write that lands in the wrong place shows. */
+static void* memtest_thread(void* arg)
+{
+	MemtestThread* t = (MemtestThread*)arg;
+	const size_t chunk_size = 64 * 1024;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(t->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (!t->gate->wait())
+		return NULL;
+	void* buffer;
+	if (posix_memalign(&buffer, 64, 2 * chunk_size) != 0)
+		buffer = NULL; /* Keep going to the barriers, report below */
+	t->no_memory = (buffer == NULL);
+	uint32_t* expected = (uint32_t*)buffer;
+	uint32_t* actual = (uint32_t*)((char*)buffer + chunk_size);
+	Stopwatch timer;
+	for (int p = 0; p < MEMTEST_PATTERNS; ++p)
+	{
+		MemtestPattern pattern = (MemtestPattern)p;
+		t->errors[p] = 0;
+		t->gate->sync();
+		timer.start();
+		for (size_t pos = 0; buffer && pos < t->bytes; pos += chunk_size)
+		{
+			size_t n = t->bytes - pos < chunk_size ? t->bytes - pos : chunk_size;
+			memtest_fill(expected, pattern, t->address + pos, n / 4);
+			t->kernel->write(t->data + pos, expected, n);
+		}
+		timer.stop();
+		t->write_us[p] = timer.elapsed_us();
+		t->gate->sync();
+		timer.start();
+		for (size_t pos = 0; buffer && pos < t->bytes; pos += chunk_size)
+		{
+			size_t n = t->bytes - pos < chunk_size ? t->bytes - pos : chunk_size;
+			memtest_fill(expected, pattern, t->address + pos, n / 4);
+			t->kernel->read(actual, t->data + pos, n);
+			for (size_t offset = 0; offset < n; offset += 4)
+			{
+				offset += find_mismatch(((char*)expected) + offset, ((char*)actual) + offset, n - offset);
+				if (offset >= n)
+					break;
+				if (t->reported.size() < MEMTEST_MAX_REPORTED)
+				{
+					MemtestError e;
+					e.address = t->address + pos + offset;
+					e.expected = expected[offset / 4];
+					e.actual = actual[offset / 4];
+					t->reported.push_back(e);
+				}
+				++t->errors[p];
+			}
+		}
+		timer.stop();
+		t->verify_us[p] = timer.elapsed_us();
+	}
+	free(buffer);
+	return NULL;
+}
+
+/* Returns the total number of errors */
+static unsigned int memtest(datra::File& file, unsigned int addr, size_t region,
+	unsigned int n_threads, const char* kernel_name, int verbose)
+{
+	const AccessKernel* kernel = kernel_name ? find_access_kernel(kernel_name) : default_bulk_kernel();
+	if (kernel == NULL)
+		throw std::runtime_error(std::string("Unknown access kernel: ") + kernel_name);
+	if (addr & (kernel->alignment - 1))
+		kernel = find_access_kernel("32");
+	region &= ~(size_t)3;
+	if (region == 0)
+		throw std::runtime_error("Region size too small");
+	off_t page_location = addr & ~(PAGE_SIZE-1);
+	unsigned int page_offset = addr & (PAGE_SIZE-1);
+	size_t size = page_offset + region;
+	if (verbose) printf("Addr: %#x (%d) offset=%#x+%#x - %#zx (%zu) kernel %s\n",
+		addr, addr, (unsigned int)page_location, page_offset, size, size, kernel->name);
+	datra::MemoryMap mapping(file, page_location, size, PROT_READ|PROT_WRITE);
+	char* data = ((char*)mapping.memory) + page_offset;
+	/* Split in 64-byte aligned parts, the last thread takes the rest */
+	size_t part = (region / n_threads) & ~(size_t)63;
+	if (part == 0)
+	{
+		n_threads = 1;
+		part = region;
+	}
+	const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	std::vector<MemtestThread> threads(n_threads);
+	StartGate gate;
+	unsigned int started;
+	for (started = 0; started < n_threads; ++started)
+	{
+		MemtestThread& t = threads[started];
+		t.gate = &gate;
+		t.cpu = n_cpus > 0 ? started % n_cpus : 0;
+		t.data = data + started * part;
+		t.address = addr + started * part;
+		t.bytes = (started == n_threads - 1) ? region - started * part : part;
+		t.kernel = kernel;
+		if (pthread_create(&t.thread, NULL, memtest_thread, &t) != 0)
+			break;
+	}
+	gate.open(started, started == n_threads);
+	for (unsigned int i = 0; i < started; ++i)
+		pthread_join(threads[i].thread, NULL);
+	if (started != n_threads)
+		throw std::runtime_error("Failed to create memtest thread");
+	for (unsigned int i = 0; i < n_threads; ++i)
+		if (threads[i].no_memory)
+			throw std::runtime_error("Out of memory for the memtest buffers");
+	unsigned int total_errors = 0;
+	for (int p = 0; p < MEMTEST_PATTERNS; ++p)
+	{
+		unsigned int errors = 0;
+		uint64_t write_us = 0;
+		uint64_t verify_us = 0;
+		for (unsigned int i = 0; i < n_threads; ++i)
+		{
+			errors += threads[i].errors[p];
+			if (threads[i].write_us[p] > write_us)
+				write_us = threads[i].write_us[p];
+			if (threads[i].verify_us[p] > verify_us)
+				verify_us = threads[i].verify_us[p];
+		}
+		MetricsRow row;
+		row.add("pattern", memtest_pattern_names[p])
+			.add("errors", errors)
+			.add("write_MBps", write_us ? region / write_us : 0)
+			.add("verify_MBps", verify_us ? region / verify_us : 0);
+		report.emit(row);
+		total_errors += errors;
+	}
+	for (unsigned int i = 0; i < n_threads; ++i)
+		for (unsigned int e = 0; e < threads[i].reported.size(); ++e)
+			fprintf(stderr, "Error @0x%04x: expected %#x actual %#x\n",
+				threads[i].reported[e].address, threads[i].reported[e].expected,
+				threads[i].reported[e].actual);
+	return total_errors;
+}
+
+int DATRA_MAIN(datraaxiprobe)(int argc, char** argv)
 {
 	int verbose = 0;
-	int node = -1;
+	std::vector<int> nodes;
+	unsigned int n_threads = 1;
 	int access = O_RDONLY; // or O_RDWR;
 	int count = 1;
 	bool long_format = false;
 	bool benchmark = false;
 	const char* short_format = " %8x";
+	const char* kernel_name = NULL;
+	const char* pattern_name = NULL;
+	size_t region = 64 * 1024;
+	size_t stride = 64;
+	unsigned int histogram_samples = 0;
+	const char* script_name = NULL;
+	const char* trace_name = NULL;
+	unsigned int period_us = 0;
+	unsigned int duration_ms = 0;
+	bool changes_only = false;
+	bool wait = false;
+	bool dump_raw = false;
+	bool dump_hex = false;
+	const char* load_name = NULL;
+	bool verify = false;
+	bool memory_test = false;
+	unsigned int timeout_ms = 1000;
+	unsigned int spin_us = 100;
 	static struct option long_options[] = {
+	   {"changes",	no_argument, 0, 'C' },
+	   {"duration",	required_argument, 0, 'D' },
+	   {"file",	required_argument, 0, 'f' },
+	   {"format",	required_argument, 0, 'F' },
+	   {"load",	required_argument, 0, 'L' },
+	   {"memtest",	no_argument, 0, 'M' },
+	   {"histogram",	required_argument, 0, 'H' },
+	   {"kernel",	required_argument, 0, 'k' },
 	   {"node",	required_argument, 0, 'n' },
+	   {"period",	required_argument, 0, 'P' },
+	   {"pattern",	required_argument, 0, 'p' },
+	   {"raw",	no_argument, 0, 'R' },
 	   {"read",		no_argument, 0, 'r' },
+	   {"spin",	required_argument, 0, 's' },
+	   {"timeout",	required_argument, 0, 'o' },
+	   {"region",	required_argument, 0, 'S' },
+	   {"stride",	required_argument, 0, 'x' },
+	   {"trace",	required_argument, 0, 'T' },
+	   {"threads",	required_argument, 0, 't' },
 	   {"verbose",	no_argument, 0, 'v' },
+	   {"verify",	no_argument, 0, 'V' },
+	   {"wait",	no_argument, 0, 'W' },
 	   {"write",	no_argument, 0, 'w' },
+	   {"xxd",	no_argument, 0, 'X' },
 	   {0,          0,           0, 0 }
 	};
 	try
@@ -78,7 +1315,7 @@ int main(int argc, char** argv)
 		int option_index = 0;
 		for (;;)
 		{
-			int c = getopt_long(argc, argv, "bc:dln:rvw",
+			int c = getopt_long(argc, argv, "bc:CdD:f:F:H:k:lL:Mn:o:p:P:rRs:S:t:T:vVwWx:X",
 							long_options, &option_index);
 			if (c < 0)
 				break;
@@ -90,33 +1327,199 @@ int main(int argc, char** argv)
 			case 'c':
 				count = strtol(optarg, NULL, 0);
 				break;
+			case 'C':
+				changes_only = true;
+				break;
 			case 'd':
 				short_format = " %8d";
 				break;
+			case 'D':
+				duration_ms = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				script_name = optarg;
+				break;
+			case 'F':
+				if (!parse_metrics_format(optarg, &report.format))
+					throw std::runtime_error(std::string("Unknown format: ") + optarg);
+				break;
+			case 'H':
+				histogram_samples = strtoul(optarg, NULL, 0);
+				if (histogram_samples == 0)
+					throw std::runtime_error("Need at least one sample");
+				break;
+			case 'k':
+				kernel_name = optarg;
+				break;
 			case 'l':
 				long_format = true;
 				break;
+			case 'L':
+				load_name = optarg;
+				break;
+			case 'M':
+				memory_test = true;
+				break;
 			case 'n':
-				node = strtol(optarg, NULL, 0);
+				nodes.push_back(strtol(optarg, NULL, 0));
+				break;
+			case 'o':
+				timeout_ms = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				pattern_name = optarg;
+				break;
+			case 'P':
+				period_us = strtoul(optarg, NULL, 0);
 				break;
 			case 'r':
 				access = O_RDONLY;
 				break;
+			case 'R':
+				dump_raw = true;
+				break;
+			case 's':
+				spin_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'S':
+				region = parse_size(optarg);
+				break;
+			case 't':
+				n_threads = strtoul(optarg, NULL, 0);
+				if (n_threads == 0)
+					throw std::runtime_error("Thread count must be at least 1");
+				break;
+			case 'T':
+				trace_name = optarg;
+				break;
 			case 'v':
 				++verbose;
 				break;
+			case 'V':
+				verify = true;
+				break;
 			case 'w':
 				access = O_RDWR;
 				break;
+			case 'W':
+				wait = true;
+				break;
+			case 'x':
+				stride = parse_size(optarg);
+				break;
+			case 'X':
+				dump_hex = true;
+				break;
 			case '?':
 				usage(argv[0]);
 				return 1;
 			}
 		}
-		
+
+		if (kernel_name && strcmp(kernel_name, "list") == 0)
+		{
+			list_access_kernels();
+			return 0;
+		}
+
+		const int node = nodes.empty() ? -1 : nodes[0];
+
+		if (script_name)
+		{
+			FILE* input = strcmp(script_name, "-") == 0 ? stdin : fopen(script_name, "r");
+			if (input == NULL)
+				throw datra::IOException(script_name);
+			unsigned int failures = run_script(ctrl, input, access, node, short_format,
+				timeout_ms, spin_us, verbose);
+			if (input != stdin)
+				fclose(input);
+			return failures ? 2 : 0;
+		}
+
+		if (wait)
+		{
+			if (argc - optind < 3)
+				throw std::runtime_error("Wait needs address, mask and value");
+			unsigned int addr = strtoul(argv[optind], NULL, 0);
+			MappingCache cache(ctrl, O_RDONLY);
+			volatile uint32_t* data = (volatile uint32_t*)cache.get(node, addr, sizeof(uint32_t));
+			RegisterWaitResult r = wait_register(data,
+				strtoul(argv[optind + 1], NULL, 0), strtoul(argv[optind + 2], NULL, 0),
+				timeout_ms * 1000ULL, spin_us);
+			MetricsRow row;
+			row.add("result", r.success ? "done" : "timeout")
+				.add("us", r.elapsed_us)
+				.add("polls", r.polls)
+				.add("value", r.value);
+			report.emit(row);
+			return r.success ? 0 : 2;
+		}
+
+		if (trace_name)
+		{
+			if (optind >= argc)
+				throw std::runtime_error("Capture needs at least one address");
+			std::vector<unsigned int> addresses;
+			for (int index = optind; index < argc; ++index)
+				addresses.push_back(strtoul(argv[index], NULL, 0));
+			capture(ctrl, node, trace_name, addresses, period_us, duration_ms,
+				changes_only, verbose);
+			return 0;
+		}
+
 		datra::File file(node < 0 ? ctrl.openControl(access) : ctrl.openConfig(node, access));
 
-		if (access == O_RDONLY)
+		if (histogram_samples)
+		{
+			if (optind >= argc)
+				throw std::runtime_error("Latency histogram needs an address");
+			unsigned int value = 0;
+			if (access != O_RDONLY)
+			{
+				if (argc - optind < 2)
+					throw std::runtime_error("Latency histogram for writes needs address and value");
+				value = strtoul(argv[optind + 1], NULL, 0);
+			}
+			latency_histogram(file, access, strtoul(argv[optind], NULL, 0),
+				value, histogram_samples, verbose);
+		}
+		else if (memory_test)
+		{
+			if (access == O_RDONLY)
+				throw std::runtime_error("Memory test writes to memory, use -w to allow it");
+			if (optind >= argc)
+				throw std::runtime_error("Memory test needs an address");
+			if (memtest(file, strtoul(argv[optind], NULL, 0), region, n_threads,
+					kernel_name, verbose))
+				return 2;
+		}
+		else if (load_name)
+		{
+			if (access == O_RDONLY)
+				throw std::runtime_error("Load writes to memory, use -w to allow it");
+			if (optind >= argc)
+				throw std::runtime_error("Load needs an address");
+			if (bulk_load(file, strtoul(argv[optind], NULL, 0), load_name,
+					count * sizeof(unsigned int), verify, kernel_name, verbose))
+				return 2;
+		}
+		else if (dump_raw || dump_hex)
+		{
+			if (optind >= argc)
+				throw std::runtime_error("Dump needs an address");
+			for (int index = optind; index < argc; ++index)
+				bulk_dump(file, strtoul(argv[index], NULL, 0), count, dump_raw,
+					kernel_name, verbose);
+		}
+		else if (pattern_name)
+		{
+			if (optind >= argc)
+				throw std::runtime_error("Pattern benchmark needs an address");
+			for (int index = optind; index < argc; ++index)
+				benchmark_patterns(file, access, strtoul(argv[index], NULL, 0),
+					pattern_name, region, stride, verbose);
+		}
+		else if (access == O_RDONLY)
 		{
 			for (int index = optind; index < argc; ++index)
 			{
@@ -128,73 +1531,39 @@ int main(int argc, char** argv)
 				if (verbose) printf("Addr: %#x (%d) offset=%#x+%#x - %#zx (%zu)\n",
 					addr, addr, (unsigned int)page_location, page_offset, size, size);
 				
+				if (benchmark)
+				{
+					std::vector<unsigned int> dest(count);
+					run_benchmark(ctrl, file, nodes, access, n_threads, addr, dest,
+						kernel_name ? kernel_name : (count > 1 ? "memcpy" : "32"), verbose);
+					continue;
+				}
+
 				datra::MemoryMap mapping(file, page_location, size, PROT_READ);
 				volatile unsigned int* data = (unsigned int*)(((char*)mapping.memory) + page_offset);
 				
-				if (benchmark)
+				if (long_format)
 				{
-					unsigned int loops = 0;
-					Stopwatch timer;
-					if (count > 1)
-					{
-						size_t blocksize = count * sizeof(unsigned int);
-						unsigned int dest[count];
-						timer.start();
-						do
-						{
-							for (unsigned int repeat = 64*1024u; repeat != 0; --repeat)
-							{
-								memcpy(dest, (void*)data, blocksize);
-							}
-							++loops;
-							timer.stop();
-						} while (timer.elapsed_us() < 1000000);
-					}
-					else
+					for (int i = 0; i < count; ++i)
 					{
-						count = 1;
-						timer.start();
-						do
-						{
-							unsigned int dest;
-							for (unsigned int repeat = 64*1024u; repeat != 0; --repeat)
-							{
-								dest += *data; /* force memory access */
-							}
-							++loops;
-							timer.stop();
-						} while (timer.elapsed_us() < 1000000);
+						unsigned int value = data[i];
+						printf("@0x%04x: %#10x (%d)\n",	(unsigned int)(addr+(i*sizeof(unsigned int))), value, (int)value);
 					}
-					unsigned int elapsed_us = timer.elapsed_us();
-					unsigned int bytes = loops * count * (64u * 1024u * sizeof(unsigned int));
-					printf("loops=%u us=%u bytes=%u hence %u MB/s\n",
-						loops, elapsed_us, bytes, bytes / elapsed_us);
 				}
 				else
 				{
-					if (long_format)
+					int j = 0;
+					int lines = (count+3)/4;
+					for (int line = 0; line < lines; ++line)
 					{
-						for (int i = 0; i < count; ++i)
+						printf("@0x%04x: ", (unsigned int)(addr + (j*sizeof(unsigned int))));
+						for (int i = j; i < count && i < j+4; ++i)
 						{
 							unsigned int value = data[i];
-							printf("@0x%04x: %#10x (%d)\n",	(unsigned int)(addr+(i*sizeof(unsigned int))), value, (int)value);
-						}
-					}
-					else
-					{
-						int j = 0;
-						int lines = (count+3)/4;
-						for (int line = 0; line < lines; ++line)
-						{
-							printf("@0x%04x: ", (unsigned int)(addr + (j*sizeof(unsigned int))));
-							for (int i = j; i < count && i < j+4; ++i)
-							{
-								unsigned int value = data[i];
-								printf(short_format, value);
-							}
-							printf("\n");
-							j += 4;
+							printf(short_format, value);
 						}
+						printf("\n");
+						j += 4;
 					}
 				}
 			}
@@ -210,9 +1579,7 @@ int main(int argc, char** argv)
 			unsigned int page_offset = addr & (PAGE_SIZE-1);
 			size_t size = addr + (values * sizeof(unsigned int)) - page_location;
 				if (verbose) printf("Addr: %#x (%d) offset=%#x+%#x - %#zx (%zu)\n", addr, addr, (unsigned int)page_location, page_offset, size, size);
-			datra::MemoryMap mapping(file, page_location, size, PROT_READ|PROT_WRITE);
-			volatile unsigned int* data = (unsigned int*)(((char*)mapping.memory) + page_offset);
-			unsigned int value[values];
+			std::vector<unsigned int> value(values);
 			const size_t blocksize = values * sizeof(unsigned int);
 			for (int index = 0; index < values; ++index)
 				value[index] = strtoul(argv[optind+index], NULL, 0);
@@ -224,26 +1591,14 @@ int main(int argc, char** argv)
 			}
 			if (benchmark)
 			{
-				unsigned int loops = 0;
-				Stopwatch timer;
-				timer.start();
-				do
-				{
-					for (unsigned int repeat = 64*1024u; repeat != 0; --repeat)
-					{
-						memcpy((void*)data, value, blocksize);
-					}
-					++loops;
-					timer.stop();
-				} while (timer.elapsed_us() < 1000000);
-				unsigned int elapsed_us = timer.elapsed_us();
-				unsigned int bytes = loops * blocksize * (64u * 1024u);
-				printf("loops=%u us=%u bytes=%u hence %u MB/s\n",
-					loops, elapsed_us, bytes, bytes / elapsed_us);
+				run_benchmark(ctrl, file, nodes, access, n_threads, addr, value,
+					kernel_name ? kernel_name : "memcpy", verbose);
 			}
 			else
 			{
-				memcpy((void*)data, value, blocksize);
+				datra::MemoryMap mapping(file, page_location, size, PROT_READ|PROT_WRITE);
+				volatile unsigned int* data = (unsigned int*)(((char*)mapping.memory) + page_offset);
+				memcpy((void*)data, &value[0], blocksize);
 			}
 		}
 	}
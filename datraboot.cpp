@@ -0,0 +1,598 @@
+/*
+ * datraboot.cpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#include "datra/hardware.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <iostream>
+#include <getopt.h>
+#include <pthread.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "licensekey.hpp"
+#include "metrics.hpp"
+#include "multicall.hpp"
+
+/* Joins the thread when it goes out of scope, also on an exception, so
+ * the thread never outlives the job it works on. */
+class ThreadJoin
+{
+	pthread_t id;
+	bool running;
+public:
+	ThreadJoin():
+		running(false)
+	{
+	}
+
+	bool start(void* (*function)(void*), void* arg)
+	{
+		running = (pthread_create(&id, NULL, function, arg) == 0);
+		return running;
+	}
+
+	void join()
+	{
+		if (running)
+			pthread_join(id, NULL);
+		running = false;
+	}
+
+	~ThreadJoin()
+	{
+		join();
+	}
+};
+
+/* One row per phase, 'count' is the number of items handled where that
+ * applies, so all rows have the same columns. */
+static void report_phase(MetricsReporter& report, const char* phase, uint64_t us,
+	unsigned int count = 0)
+{
+	MetricsRow row;
+	row.add("phase", phase).add("us", us).add("count", count);
+	report.emit(row);
+}
+
+static void usage(const char* name)
+{
+	std::cerr << "usage: " << name << " [-v] [-F format] [-b bitstream_path] config\n"
+		" -v    verbose mode.\n"
+		" -b    Bitstream base path (default /usr/share/bitstreams)\n"
+		" -F    Format of the timing report: text (default), json or csv\n"
+		" config  System description, '-' for stdin. One statement per line:\n"
+		"   bitstreams PATH           bitstream base path\n"
+		"   license key VALUE         write license key\n"
+		"   license file PATH [OFS]   read binary key from file (or EEPROM)\n"
+		"   license ascii PATH        read key from text file\n"
+		"   function NAME [N ...]     program NAME into nodes N, or into the\n"
+		"                             first free partition when none given\n"
+		"   clear                     delete all routes before adding\n"
+		"   route SRC DST             route node.fifo to node.fifo, node can\n"
+		"                             be a number or a function name\n"
+		"Brings up the system in one process: writes the license while the\n"
+		"bitstreams are being read ahead, then programs all functions and\n"
+		"sends the route table in one go. Prints the time spent per phase.\n";
+}
+
+class ConfigError: public std::exception
+{
+	std::string msg;
+public:
+	ConfigError(int line, const char *what):
+		msg("Failed to parse line ")
+	{
+		char number[16];
+		snprintf(number, sizeof(number), "%d", line);
+		msg += number;
+		msg += ": ";
+		msg += what;
+	}
+	const char* what() const throw()
+	{
+		return msg.c_str();
+	}
+	~ConfigError() throw()
+	{
+	}
+};
+
+struct Placement
+{
+	std::string function;
+	int node; /* -1 to pick any free partition */
+	std::string bitstream;
+};
+
+struct Endpoint
+{
+	std::string node; /* Number or function name */
+	int fifo;
+};
+
+struct BootConfig
+{
+	enum { LICENSE_NONE, LICENSE_KEY, LICENSE_FILE, LICENSE_ASCII } license;
+	unsigned long long key;
+	std::string license_file;
+	off_t license_offset;
+	std::vector<Placement> placements;
+	bool clear_routes;
+	std::vector<std::pair<Endpoint, Endpoint> > routes;
+
+	BootConfig():
+		license(LICENSE_NONE),
+		key(0),
+		license_offset(0),
+		clear_routes(false)
+	{
+	}
+};
+
+static const char* const separators = " \t\r\n";
+
+/* Nodes that can hold a function, as in the partition bitmask */
+#define BOOT_MIN_NODE 1
+#define BOOT_MAX_NODE 31
+
+/* The whole of txt as a number in [min, max] */
+static bool parse_number(const char* txt, long min, long max, int* value)
+{
+	char* end;
+	errno = 0;
+	long v = strtol(txt, &end, 0);
+	if (end == txt || *end || errno || v < min || v > max)
+		return false;
+	*value = v;
+	return true;
+}
+
+static Endpoint parse_endpoint(int line_number, const char* txt)
+{
+	if (txt == NULL)
+		throw ConfigError(line_number, "route needs source and destination");
+	Endpoint result;
+	const char* dot = strchr(txt, '.');
+	if (dot)
+	{
+		result.node.assign(txt, dot - txt);
+		if (!parse_number(dot + 1, 0, UCHAR_MAX, &result.fifo))
+			throw ConfigError(line_number, "invalid fifo number");
+	}
+	else
+	{
+		result.node = txt;
+		result.fifo = 0;
+	}
+	/* Anything that reads as a number must be a node number that fits
+	 * a route, everything else is a function name */
+	char* end;
+	int node;
+	strtol(result.node.c_str(), &end, 0);
+	if (*end == '\0' && !result.node.empty() &&
+			!parse_number(result.node.c_str(), 0, UCHAR_MAX, &node))
+		throw ConfigError(line_number, "invalid node number");
+	return result;
+}
+
+static void parse_config(FILE* input, BootConfig* config, datra::HardwareContext& context)
+{
+	char line[1024];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), input) != NULL)
+	{
+		++line_number;
+		char* comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+		const char* command = strtok(line, separators);
+		if (command == NULL)
+			continue;
+		if (strcmp(command, "bitstreams") == 0)
+		{
+			const char* path = strtok(NULL, separators);
+			if (path == NULL)
+				throw ConfigError(line_number, "bitstreams needs a path");
+			context.setBitstreamBasepath(path);
+		}
+		else if (strcmp(command, "license") == 0)
+		{
+			const char* type = strtok(NULL, separators);
+			const char* arg = strtok(NULL, separators);
+			if (type == NULL || arg == NULL)
+				throw ConfigError(line_number, "license needs type and value");
+			if (strcmp(type, "key") == 0)
+			{
+				config->license = BootConfig::LICENSE_KEY;
+				if (!parse_key(arg, &config->key))
+					throw ConfigError(line_number, "invalid license key");
+			}
+			else if (strcmp(type, "file") == 0)
+			{
+				config->license = BootConfig::LICENSE_FILE;
+				config->license_file = arg;
+				const char* offset = strtok(NULL, separators);
+				if (offset)
+				{
+					char* end;
+					config->license_offset = strtoll(offset, &end, 0);
+					if (end == offset || *end || config->license_offset < 0)
+						throw ConfigError(line_number, "invalid license offset");
+				}
+			}
+			else if (strcmp(type, "ascii") == 0)
+			{
+				config->license = BootConfig::LICENSE_ASCII;
+				config->license_file = arg;
+			}
+			else
+				throw ConfigError(line_number, type);
+		}
+		else if (strcmp(command, "function") == 0)
+		{
+			const char* name = strtok(NULL, separators);
+			if (name == NULL)
+				throw ConfigError(line_number, "function needs a name");
+			Placement placement;
+			placement.function = name;
+			placement.node = -1;
+			bool any = false;
+			for (const char* arg = strtok(NULL, separators); arg; arg = strtok(NULL, separators))
+			{
+				if (!parse_number(arg, BOOT_MIN_NODE, BOOT_MAX_NODE, &placement.node))
+					throw ConfigError(line_number, "invalid node number");
+				config->placements.push_back(placement);
+				any = true;
+			}
+			if (!any)
+				config->placements.push_back(placement);
+		}
+		else if (strcmp(command, "clear") == 0)
+		{
+			config->clear_routes = true;
+		}
+		else if (strcmp(command, "route") == 0)
+		{
+			Endpoint src = parse_endpoint(line_number, strtok(NULL, separators));
+			Endpoint dst = parse_endpoint(line_number, strtok(NULL, separators));
+			config->routes.push_back(std::make_pair(src, dst));
+		}
+		else
+			throw ConfigError(line_number, command);
+	}
+}
+
+/* Fill in node numbers for "any" placements and find the bitstreams.
+ * All nodes are opened and kept open until exit, so nobody else grabs
+ * them, and a node someone else holds is not touched. */
+static void place_functions(datra::HardwareContext& context, BootConfig* config,
+	std::vector<int>* handles)
+{
+	unsigned int taken = 0;
+	for (std::vector<Placement>::const_iterator p = config->placements.begin();
+			p != config->placements.end(); ++p)
+		if (p->node >= 0)
+			taken |= (1u << p->node);
+	unsigned int claimed = 0;
+	for (std::vector<Placement>::iterator p = config->placements.begin();
+			p != config->placements.end(); ++p)
+	{
+		if (p->node >= 0)
+		{
+			std::ostringstream node;
+			node << p->node;
+			if (claimed & (1u << p->node))
+				throw std::runtime_error("Node " + node.str() + " used for more than one function");
+			int handle = context.openConfig(p->node, O_RDWR);
+			if (handle == -1)
+			{
+				if (errno == EBUSY)
+					throw std::runtime_error("Node " + node.str() + " is in use");
+				throw datra::IOException(p->function.c_str());
+			}
+			handles->push_back(handle);
+			claimed |= (1u << p->node);
+		}
+		else
+		{
+			unsigned int candidates = context.getAvailablePartitions(p->function.c_str());
+			for (int id = BOOT_MIN_NODE; id <= BOOT_MAX_NODE && p->node < 0; ++id)
+			{
+				if (((candidates & ~taken) & (1u << id)) == 0)
+					continue;
+				int handle = context.openConfig(id, O_RDWR);
+				if (handle == -1)
+				{
+					if (errno != EBUSY)
+						throw datra::IOException(p->function.c_str());
+					continue;
+				}
+				handles->push_back(handle);
+				p->node = id;
+				taken |= (1u << id);
+				claimed |= (1u << id);
+			}
+			if (p->node < 0)
+				throw std::runtime_error("No free partition for " + p->function);
+		}
+		p->bitstream = context.findPartition(p->function.c_str(), p->node);
+		if (p->bitstream.empty())
+			throw std::runtime_error("Function " + p->function + " not available for its node");
+	}
+}
+
+struct LicenseJob
+{
+	const BootConfig* config;
+	datra::HardwareControl* control; /* its own until joined */
+	uint64_t elapsed_us;
+	std::string error;
+};
+
+static void* license_thread(void* arg)
+{
+	LicenseJob* job = (LicenseJob*)arg;
+	Stopwatch timer;
+	try
+	{
+		datra::HardwareControl& control = *job->control;
+		const BootConfig* config = job->config;
+		switch (config->license)
+		{
+		case BootConfig::LICENSE_KEY:
+			control.writeDatraLicense(config->key);
+			break;
+		case BootConfig::LICENSE_FILE:
+			{
+				unsigned long long key;
+				datra::File input(config->license_file.c_str(), O_RDONLY);
+				if (config->license_offset)
+					input.seek(config->license_offset);
+				input.read(&key, sizeof(key));
+				control.writeDatraLicense(key);
+			}
+			break;
+		case BootConfig::LICENSE_ASCII:
+			control.writeDatraLicenseFile(config->license_file.c_str());
+			break;
+		case BootConfig::LICENSE_NONE:
+			break;
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		job->error = ex.what();
+	}
+	timer.stop();
+	job->elapsed_us = timer.elapsed_us();
+	return NULL;
+}
+
+struct PrefetchJob
+{
+	std::vector<std::string> files;
+	uint64_t elapsed_us;
+};
+
+/* Pull the bitstreams into the page cache, in programming order, so the
+ * programming phase doesn't wait for the storage. Failures don't matter
+ * here, programming will report them. */
+static void* prefetch_thread(void* arg)
+{
+	PrefetchJob* job = (PrefetchJob*)arg;
+	Stopwatch timer;
+	std::vector<int> handles;
+	for (unsigned int i = 0; i < job->files.size(); ++i)
+	{
+		int fd = ::open(job->files[i].c_str(), O_RDONLY);
+		if (fd != -1)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		handles.push_back(fd);
+	}
+	for (unsigned int i = 0; i < handles.size(); ++i)
+	{
+		if (handles[i] == -1)
+			continue;
+		off_t size = lseek(handles[i], 0, SEEK_END);
+		if (size > 0)
+			readahead(handles[i], 0, size);
+		::close(handles[i]);
+	}
+	timer.stop();
+	job->elapsed_us = timer.elapsed_us();
+	return NULL;
+}
+
+static int resolve_node(const Endpoint& endpoint, const std::map<std::string, int>& functions)
+{
+	char* end;
+	long node = strtol(endpoint.node.c_str(), &end, 0);
+	if (*end == '\0' && !endpoint.node.empty())
+		return node;
+	std::map<std::string, int>::const_iterator it = functions.find(endpoint.node);
+	if (it == functions.end())
+		throw std::runtime_error("Route to unknown function " + endpoint.node);
+	return it->second;
+}
+
+int DATRA_MAIN(datraboot)(int argc, char** argv)
+{
+	static struct option long_options[] = {
+	   {"format",	required_argument, 0, 'F' },
+	   {"verbose",	no_argument, 0, 'v' },
+	   {0,          0,           0, 0 }
+	};
+	bool verbose = false;
+	MetricsReporter report;
+	try
+	{
+		Stopwatch total;
+		datra::HardwareContext context;
+		int option_index = 0;
+		for (;;)
+		{
+			int c = getopt_long(argc, argv, "b:F:v",
+							long_options, &option_index);
+			if (c < 0)
+				break;
+			switch (c)
+			{
+			case 'b':
+				context.setBitstreamBasepath(optarg);
+				break;
+			case 'F':
+				if (!parse_metrics_format(optarg, &report.format))
+					throw std::runtime_error(std::string("Unknown format: ") + optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			case '?':
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		if (optind >= argc)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+
+		Stopwatch timer;
+		BootConfig config;
+		{
+			FILE* input = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+			if (input == NULL)
+				throw datra::IOException(argv[optind]);
+			parse_config(input, &config, context);
+			if (input != stdin)
+				fclose(input);
+		}
+		timer.stop();
+		uint64_t parse_us = timer.elapsed_us();
+
+		/* One control for all steps, the license thread has it to
+		 * itself until it is joined */
+		datra::HardwareControl control(context);
+		timer.start();
+		std::vector<int> handles;
+		place_functions(context, &config, &handles);
+		timer.stop();
+		uint64_t place_us = timer.elapsed_us();
+
+		/* License and prefetch run while we get on with things */
+		LicenseJob license;
+		license.config = &config;
+		license.control = &control;
+		license.elapsed_us = 0;
+		ThreadJoin licensing;
+		if (!licensing.start(license_thread, &license))
+			throw std::runtime_error("Failed to create license thread");
+		PrefetchJob prefetch;
+		prefetch.elapsed_us = 0;
+		for (unsigned int i = 0; i < config.placements.size(); ++i)
+			prefetch.files.push_back(config.placements[i].bitstream);
+		ThreadJoin prefetching;
+		prefetching.start(prefetch_thread, &prefetch);
+
+		/* Programming needs the license in place */
+		timer.start();
+		licensing.join();
+		if (!license.error.empty())
+			throw std::runtime_error("License: " + license.error);
+		timer.stop();
+		uint64_t license_wait_us = timer.elapsed_us();
+
+		timer.start();
+		std::map<std::string, int> functions;
+		for (std::vector<Placement>::const_iterator p = config.placements.begin();
+				p != config.placements.end(); ++p)
+		{
+			Stopwatch node_timer;
+			control.disableNode(p->node);
+			unsigned int bytes = control.program(p->bitstream.c_str());
+			control.enableNode(p->node);
+			node_timer.stop();
+			if (verbose)
+				std::cerr << "Programmed '" << p->function << "' into " << p->node
+					<< " using " << p->bitstream << " " << bytes << " bytes in "
+					<< node_timer.elapsed_us() << " us" << std::endl;
+			if (functions.find(p->function) == functions.end())
+				functions[p->function] = p->node;
+		}
+		timer.stop();
+		uint64_t program_us = timer.elapsed_us();
+		prefetching.join();
+
+		timer.start();
+		if (config.clear_routes)
+			control.routeDeleteAll();
+		std::vector<datra::HardwareControl::Route> routes;
+		for (unsigned int i = 0; i < config.routes.size(); ++i)
+		{
+			datra::HardwareControl::Route route;
+			route.srcNode = resolve_node(config.routes[i].first, functions);
+			route.srcFifo = config.routes[i].first.fifo;
+			route.dstNode = resolve_node(config.routes[i].second, functions);
+			route.dstFifo = config.routes[i].second.fifo;
+			if (verbose)
+				std::cerr << "Route "
+					<< (int)route.srcNode << "." << (int)route.srcFifo
+					<< "->"
+					<< (int)route.dstNode << "." << (int)route.dstFifo
+					<< std::endl;
+			routes.push_back(route);
+		}
+		if (!routes.empty())
+			control.routeAdd(&routes[0], routes.size());
+		timer.stop();
+		uint64_t route_us = timer.elapsed_us();
+		total.stop();
+
+		report_phase(report, "parse", parse_us);
+		report_phase(report, "place", place_us, config.placements.size());
+		report_phase(report, "license", license.elapsed_us);
+		report_phase(report, "license_wait", license_wait_us);
+		report_phase(report, "prefetch", prefetch.elapsed_us);
+		report_phase(report, "program", program_us);
+		report_phase(report, "routes", route_us, routes.size());
+		report_phase(report, "total", total.elapsed_us());
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "ERROR:\n" << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -28,13 +28,27 @@
 #include "datra/hardware.hpp"
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <getopt.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "licensekey.hpp"
+#include "metrics.hpp"
+#include "multicall.hpp"
 
 static void usage(const char* name)
 {
 	std::cerr << "usage: " << name << " [-a|-b] [-o offset] [-v] [-w key] file\n"
 		     "       " << name << " {-r|-i}\n"
+		     "       " << name << " -B csv [-o offset] [-j jobs] [-F format] [-v] [image]\n"
 		" -a    ASCII mode\n"
 		" -b    binary mode (default)\n"
 		" -o    offset in binary file\n"
@@ -42,13 +56,297 @@ static void usage(const char* name)
 		" -i    read device ID from driver and write to stdout in hex\n"
 		" -v    verbose mode\n"
 		" -w    write key to file instead of reading it\n"
+		" -B    batch mode, read device IDs and keys from a CSV file with lines\n"
+		"       'device_id,key[,file]'. With an image name (in which %s stands for\n"
+		"       the device ID) or a file per line, writes each key into its image\n"
+		"       file at the offset and reads it back. Without, finds this\n"
+		"       device's ID in the CSV and programs its key into the hardware.\n"
+		" -j    batch mode: files to write in parallel (default: CPU count)\n"
+		" -F    batch mode summary format: text (default), json or csv\n"
 		" file  file (or device) to read key from or to write it to\n"
 		"Activates a Datra license by writing it to the hardware. Must be called\n"
 		"early at boot. File can be a regular file or e.g. an EEPROM device.\n"
-		"When -r is specified, it reads back the key from hardware instead.\n";
+		"When -r is specified, it reads back the key from hardware instead.\n"
+		"A key that is already in place is not written again, to spare EEPROMs.\n";
 }
 
-int main(int argc, char** argv)
+static unsigned long long key_argument(const char* text)
+{
+	unsigned long long key;
+	if (!parse_key(text, &key))
+		throw std::runtime_error(std::string("Invalid key: ") + text);
+	return key;
+}
+
+/* Returns false when the hardware already had the key */
+static bool program_key(datra::HardwareControl& control, unsigned long long key, bool verbose)
+{
+	if (control.readDatraLicense() == key)
+	{
+		if (verbose)
+			std::cerr << std::hex << "Key " << key << " already programmed" << std::dec << std::endl;
+		return false;
+	}
+	if (verbose)
+		std::cerr << std::hex << "Programming key " << key << std::dec << std::endl;
+	control.writeDatraLicense(key);
+	return true;
+}
+
+enum PatchStatus
+{
+	PATCH_WRITTEN,
+	PATCH_UNCHANGED,
+	PATCH_FAILED
+};
+
+/* Puts the key into the file at offset, unless it is there already, and
+ * reads it back. The rest of the file is left alone. */
+static PatchStatus patch_key(const char* filename, off_t offset, unsigned long long key, std::string* error)
+{
+	int fd = ::open(filename, O_RDWR|O_CREAT, 0644);
+	if (fd == -1)
+	{
+		*error = strerror(errno);
+		return PATCH_FAILED;
+	}
+	PatchStatus result = PATCH_WRITTEN;
+	unsigned long long current;
+	if (::pread(fd, &current, sizeof(current), offset) == sizeof(current) && current == key)
+		result = PATCH_UNCHANGED;
+	else
+	{
+		errno = 0; /* A short write leaves it alone */
+		if (::pwrite(fd, &key, sizeof(key), offset) != sizeof(key))
+		{
+			*error = errno ? strerror(errno) : "short write";
+			result = PATCH_FAILED;
+		}
+		else if (::pread(fd, &current, sizeof(current), offset) != sizeof(current) || current != key)
+		{
+			*error = "verify failed, key did not read back";
+			result = PATCH_FAILED;
+		}
+	}
+	::close(fd);
+	return result;
+}
+
+struct LicenseEntry
+{
+	unsigned int line;
+	std::string device_id;
+	unsigned long long key;
+	std::string file;
+	PatchStatus status;
+	std::string error;
+};
+
+static std::string trim(const std::string& s)
+{
+	std::string::size_type begin = s.find_first_not_of(" \t\r");
+	if (begin == std::string::npos)
+		return std::string();
+	return s.substr(begin, s.find_last_not_of(" \t\r") + 1 - begin);
+}
+
+/* Lines "device_id,key[,file]". Empty lines and those starting with '#'
+ * are skipped, and so is a first line without a valid key (a header). */
+static void read_batch(const char* filename, const char* image, std::vector<LicenseEntry>* entries)
+{
+	std::ifstream input(filename);
+	if (!input)
+		throw datra::IOException(filename);
+	std::string text;
+	unsigned int line = 0;
+	unsigned int from_image = 0;
+	while (std::getline(input, text))
+	{
+		++line;
+		text = trim(text);
+		if (text.empty() || text[0] == '#')
+			continue;
+		std::vector<std::string> fields;
+		std::string::size_type start = 0;
+		for (;;)
+		{
+			std::string::size_type comma = text.find(',', start);
+			fields.push_back(trim(text.substr(start, comma == std::string::npos ? comma : comma - start)));
+			if (comma == std::string::npos)
+				break;
+			start = comma + 1;
+		}
+		LicenseEntry entry;
+		entry.line = line;
+		entry.status = PATCH_FAILED;
+		if (fields.size() < 2 || fields.size() > 3 || !parse_key(fields[1].c_str(), &entry.key))
+		{
+			if (line == 1)
+				continue;
+			std::ostringstream msg;
+			msg << filename << ":" << line << ": expected device_id,key[,file]";
+			throw std::runtime_error(msg.str());
+		}
+		entry.device_id = fields[0];
+		if (fields.size() > 2)
+			entry.file = fields[2];
+		if (entry.file.empty() && image)
+		{
+			++from_image;
+			entry.file = image;
+			std::string::size_type pos = entry.file.find("%s");
+			if (pos != std::string::npos)
+				entry.file.replace(pos, 2, entry.device_id);
+		}
+		entries->push_back(entry);
+	}
+	if (from_image > 1 && strstr(image, "%s") == NULL)
+		throw std::runtime_error(std::string("Image name needs %s for more than one device: ") + image);
+}
+
+struct PatchWorker
+{
+	pthread_t thread;
+	std::vector<LicenseEntry>* entries;
+	volatile unsigned int* next;
+	off_t offset;
+};
+
+static void* patch_thread(void* arg)
+{
+	PatchWorker* w = (PatchWorker*)arg;
+	for (;;)
+	{
+		unsigned int i = __sync_fetch_and_add(w->next, 1);
+		if (i >= w->entries->size())
+			break;
+		LicenseEntry& e = (*w->entries)[i];
+		e.status = patch_key(e.file.c_str(), w->offset, e.key, &e.error);
+	}
+	return NULL;
+}
+
+/* Returns the number of failures */
+static unsigned int batch_images(std::vector<LicenseEntry>& entries, off_t offset,
+	unsigned int jobs, MetricsFormat format, bool verbose)
+{
+	for (std::vector<LicenseEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+		if (e->file.empty())
+		{
+			std::ostringstream msg;
+			msg << "Line " << e->line << ": no file for device " << e->device_id
+				<< ", give one in the CSV or an image name with %s";
+			throw std::runtime_error(msg.str());
+		}
+	/* The workers write in parallel, two keys for one file would race.
+	 * Existing files are told apart by inode, so other spellings of the
+	 * same path are caught too. */
+	std::map<std::string, unsigned int> targets;
+	for (std::vector<LicenseEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+	{
+		std::string target = e->file;
+		struct stat info;
+		if (::stat(e->file.c_str(), &info) == 0)
+		{
+			std::ostringstream id;
+			id << info.st_dev << ":" << info.st_ino;
+			target = id.str();
+		}
+		std::map<std::string, unsigned int>::const_iterator other = targets.find(target);
+		if (other != targets.end())
+		{
+			std::ostringstream msg;
+			msg << "Line " << e->line << ": " << e->file << " is also the file for line "
+				<< other->second << ", each device needs its own";
+			throw std::runtime_error(msg.str());
+		}
+		targets[target] = e->line;
+	}
+	Stopwatch timer;
+	volatile unsigned int next = 0;
+	if (jobs > entries.size())
+		jobs = entries.size();
+	std::vector<PatchWorker> workers(jobs ? jobs : 1);
+	unsigned int started = 0;
+	for (; started < jobs; ++started)
+	{
+		workers[started].entries = &entries;
+		workers[started].next = &next;
+		workers[started].offset = offset;
+		if (pthread_create(&workers[started].thread, NULL, patch_thread, &workers[started]) != 0)
+			break;
+	}
+	if (!started)
+	{
+		/* No threads to be had, do it here */
+		workers[0].entries = &entries;
+		workers[0].next = &next;
+		workers[0].offset = offset;
+		patch_thread(&workers[0]);
+	}
+	for (unsigned int i = 0; i < started; ++i)
+		pthread_join(workers[i].thread, NULL);
+	timer.stop();
+	unsigned int written = 0;
+	unsigned int unchanged = 0;
+	unsigned int failed = 0;
+	for (std::vector<LicenseEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+	{
+		switch (e->status)
+		{
+		case PATCH_WRITTEN:
+			++written;
+			if (verbose)
+				std::cerr << e->device_id << ": " << e->file << " written" << std::endl;
+			break;
+		case PATCH_UNCHANGED:
+			++unchanged;
+			if (verbose)
+				std::cerr << e->device_id << ": " << e->file << " already has the key" << std::endl;
+			break;
+		case PATCH_FAILED:
+			++failed;
+			std::cerr << "Line " << e->line << ", device " << e->device_id << ": "
+				<< e->file << ": " << e->error << std::endl;
+			break;
+		}
+	}
+	MetricsReporter report(stdout, format);
+	MetricsRow row;
+	row.add("boards", (unsigned int)entries.size())
+		.add("written", written)
+		.add("unchanged", unchanged)
+		.add("failed", failed)
+		.add("jobs", started ? started : 1)
+		.add("us", timer.elapsed_us())
+		.add("boards_per_s", timer.elapsed_ns() ? entries.size() * 1e9 / timer.elapsed_ns() : 0.0);
+	report.emit(row);
+	return failed;
+}
+
+/* On the device: program the key that the CSV lists for this device ID */
+static void batch_device(const std::vector<LicenseEntry>& entries, bool verbose)
+{
+	datra::HardwareContext context;
+	datra::HardwareControl control(context);
+	unsigned long long device_id = control.readDatraDeviceID();
+	for (std::vector<LicenseEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+	{
+		unsigned long long id;
+		if (parse_key(e->device_id.c_str(), &id) && id == device_id)
+		{
+			if (verbose)
+				std::cerr << "Device " << e->device_id << ", line " << e->line << std::endl;
+			program_key(control, e->key, verbose);
+			return;
+		}
+	}
+	std::ostringstream msg;
+	msg << std::hex << "Device ID 0x" << device_id << " not found in the batch file";
+	throw std::runtime_error(msg.str());
+}
+
+int DATRA_MAIN(datralicense)(int argc, char** argv)
 {
 	bool ascii_mode = false;
 	bool verbose = false;
@@ -57,12 +355,18 @@ int main(int argc, char** argv)
 	bool read_deviceid = false;
 	unsigned long long key;
 	off_t offset = 0;
+	const char* batch_file = NULL;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	MetricsFormat format = METRICS_TEXT;
 
 	try
 	{
 		static struct option long_options[] = {
 		   {"ascii",	no_argument, 0, 'a' },
+		   {"batch",	required_argument, 0, 'B' },
 		   {"binary",	no_argument, 0, 'b' },
+		   {"format",	required_argument, 0, 'F' },
+		   {"jobs",	required_argument, 0, 'j' },
 		   {"offset", required_argument, 0, 'o' },
 		   {"read",	no_argument, 0, 'r' },
 		   {"id",	no_argument, 0, 'i' },
@@ -73,7 +377,7 @@ int main(int argc, char** argv)
 		int option_index = 0;
 		for (;;)
 		{
-			int c = getopt_long(argc, argv, "abio:rvw:",
+			int c = getopt_long(argc, argv, "aB:bF:ij:o:rvw:",
 							long_options, &option_index);
 			if (c < 0)
 				break;
@@ -82,9 +386,19 @@ int main(int argc, char** argv)
 			case 'a':
 				ascii_mode = true;
 				break;
+			case 'B':
+				batch_file = optarg;
+				break;
 			case 'b':
 				ascii_mode = false;
 				break;
+			case 'F':
+				if (!parse_metrics_format(optarg, &format))
+					throw std::runtime_error(std::string("Unknown format: ") + optarg);
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
 			case 'i':
 				read_deviceid = true;
 				break;
@@ -99,31 +413,46 @@ int main(int argc, char** argv)
 				break;
 			case 'w':
 				write_mode = true;
-				key = strtoll(optarg, NULL, 0);
+				key = key_argument(optarg);
 				break;
 			case '?':
 				usage(argv[0]);
 				return 1;
 			}
 		}
-		if (write_mode)
+		if (batch_file)
+		{
+			std::vector<LicenseEntry> entries;
+			read_batch(batch_file, optind < argc ? argv[optind] : NULL, &entries);
+			if (entries.empty())
+				throw std::runtime_error(std::string("No keys in ") + batch_file);
+			bool to_files = (optind < argc);
+			for (std::vector<LicenseEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e)
+				if (!e->file.empty())
+					to_files = true;
+			if (!to_files)
+				batch_device(entries, verbose);
+			else if (batch_images(entries, offset, jobs > 0 ? jobs : 1, format, verbose))
+				return 1;
+		}
+		else if (write_mode)
 		{
 			if (optind < argc)
 			{
 				if (verbose)
 					std::cerr << std::hex << "Writing key " << key << " to " << argv[optind] << " at " << std::dec << offset << std::endl;
-				datra::File output(::open(argv[optind], O_WRONLY|O_CREAT, 0644));
-				if (offset)
-					output.seek(offset);
-				output.write(&key, sizeof(key));
+				std::string error;
+				PatchStatus status = patch_key(argv[optind], offset, key, &error);
+				if (status == PATCH_FAILED)
+					throw std::runtime_error(std::string(argv[optind]) + ": " + error);
+				if (verbose && status == PATCH_UNCHANGED)
+					std::cerr << "Key already in place" << std::endl;
 			}
 			else
 			{
-				if (verbose)
-					std::cerr << std::hex << "Programming key " << key << std::endl;
 				datra::HardwareContext context;
 				datra::HardwareControl control(context);
-				control.writeDatraLicense(key);
+				program_key(control, key, verbose);
 			}
 		}
 		else
@@ -161,9 +490,7 @@ int main(int argc, char** argv)
 							input.seek(offset);
 						input.read(&key, sizeof(key));
 					}
-					if (verbose)
-							std::cerr << std::hex << "Programming key " << key << std::endl;
-					control.writeDatraLicense(key);
+					program_key(control, key, verbose);
 				}
 			}
 		}
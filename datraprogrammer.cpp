@@ -30,25 +30,39 @@
 #include <unistd.h>
 #include <iostream>
 #include <getopt.h>
+#include <vector>
+#include "hotswap.hpp"
+#include "multicall.hpp"
+#include "tracepoints.hpp"
 
 static void usage(const char* name)
 {
-    std::cerr << "usage: " << name << " [-v] [-b bitstream_path] function N [N] ..\n"
+    std::cerr << "usage: " << name << " [-v] [-s [-n]] [-b bitstream_path] function N [N] ..\n"
         " -v        verbose mode.\n"
         " -b        Bitstream base path (default /usr/share/bitstreams)\n"
+        " -s        Swap: program the function into a free partition while\n"
+        "           node N keeps running, then move N's routes over and\n"
+        "           disable N. Prints the new node numbers.\n"
+        " -n        With -s, only show the node and route changes it would make\n"
         " function  Function to be programmed\n"
         " N         Node index(es) to program the function to\n"
         "\n"
         "Programs functions into Datra's reconfigurable partitions.\n"
         "For example, to put an adder into nodes 1 and 2, and a fir into 3:\n"
         "  " << name << " adder 1 2 fir 3\n"
+        "To replace the function in node 2 of a running pipeline by a fir:\n"
+        "  " << name << " -s fir 2\n"
         "This requires bitstreams for these functions to be present.\n";
 }
 
-int main(int argc, char** argv)
+int DATRA_MAIN(datraprogrammer)(int argc, char** argv)
 {
     bool verbose = false;
+    bool swap = false;
+    bool dry_run = false;
     static struct option long_options[] = {
+       {"dry-run", no_argument, 0, 'n' },
+       {"swap",    no_argument, 0, 's' },
        {"verbose", no_argument, 0, 'v' },
        {0,         0,           0, 0 }
     };
@@ -61,7 +75,7 @@ int main(int argc, char** argv)
         int option_index = 0;
         for (;;)
         {
-            int c = getopt_long(argc, argv, "b:v",
+            int c = getopt_long(argc, argv, "b:nsv",
                                 long_options, &option_index);
             if (c < 0) 
             {
@@ -73,6 +87,12 @@ int main(int argc, char** argv)
             case 'b':
                 ctx.setBitstreamBasepath(optarg);
                 break;
+            case 'n':
+                dry_run = true;
+                break;
+            case 's':
+                swap = true;
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -83,6 +103,9 @@ int main(int argc, char** argv)
         }
         
         const char* function_name = NULL;
+        /* Swapped-to nodes stay claimed until exit, so a later swap in
+         * the same run cannot pick one of them */
+        std::vector<int> claimed;
 
         for (; optind < argc; ++optind)
         {
@@ -98,6 +121,21 @@ int main(int argc, char** argv)
                     std::cerr << "Must set a function name before the number " << node_index << std::endl;
                     return 1;
                 }
+
+                if (swap)
+                {
+                    HotSwapResult swapped = hotswap_function(ctx, control, function_name, node_index, verbose, dry_run);
+                    if (swapped.config != -1)
+                        claimed.push_back(swapped.config);
+                    if (verbose && !dry_run)
+                    {
+                        std::cerr << "Node " << node_index << " -> " << swapped.node << ": "
+                            << swapped.bytes << " bytes in " << swapped.program_us << " us, "
+                            << swapped.routes << " routes moved in " << swapped.reroute_us << " us." << std::endl;
+                    }
+                    std::cout << swapped.node << std::endl;
+                    continue;
+                }
                 
                 std::string filename = ctx.findPartition(function_name, node_index);
                 if (filename.empty())
@@ -114,9 +152,11 @@ int main(int argc, char** argv)
                 datra::File input_file(filename.c_str(), O_RDONLY);
                 datra::HardwareConfig cfg(ctx, node_index);
 
+                DATRA_PROBE2(datraprogrammer, program_start, node_index, function_name);
                 cfg.disableNode();
                 unsigned int r = control.program(input_file);
                 cfg.enableNode();
+                DATRA_PROBE2(datraprogrammer, program_end, node_index, r);
 
                 if (verbose)
                 {
@@ -128,6 +168,8 @@ int main(int argc, char** argv)
                 function_name = arg;
             }
         }
+        for (unsigned int i = 0; i < claimed.size(); ++i)
+            ::close(claimed[i]);
     }
     catch (const std::exception& ex)
     {
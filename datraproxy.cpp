@@ -35,17 +35,60 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
+#include <string.h>
+#include <deque>
+#include "autotune.hpp"
+#include "endpoints.hpp"
+#include "framing.hpp"
+#include "metrics.hpp"
+#include "multicall.hpp"
+#include "pipelinegraph.hpp"
+#include "proxystats.hpp"
+#include "tracepoints.hpp"
 
 using datra::IOException;
 
+/* Input ring size, in blocks */
+#define INPUT_BLOCKS 4
+
 static void usage(const char* name)
 {
-	std::cerr << "usage: " << name << " [-s blocksize] [-v] function [function ...]\n"
+	std::cerr << "usage: " << name << " [-s blocksize] [-A goal] [-i input] [-o output] [-m name] [-r records] [-v] pipeline\n"
 		"Runs data from stdin/stdout via Datra hardware. Automatically allocates\n"
 		"and programs partitions. Multiple functions will be linked in hardware.\n"
+		" pipeline  Functions, separated by '|' or given as separate arguments.\n"
+		"       split(A,B,..) runs branches A, B.. side by side: the stage in\n"
+		"       front of it feeds branch N from its output fifo N (the proxy\n"
+		"       itself copies its input to each), the stage after it gets\n"
+		"       branch N on input fifo N. A branch can be a pipeline itself.\n"
 		" -v    verbose mode.\n"
 		" -s .. Blocksize in bytes, default is 4k.\n"
-		"Example: mpg123 -s music.mp3 | " << name << " lowPass reverb | aplay -f cd\n";
+		" -A .. Adapt the blocksize while running, starting at -s. Goal is\n"
+		"       'throughput', or 'latency=US' for the best throughput that\n"
+		"       keeps the latency under US microseconds. Latency is measured\n"
+		"       per record with -r, otherwise estimated from the bytes in\n"
+		"       flight. The size it settles on is reported on stderr.\n"
+		" -i .. Read input from here instead of stdin, and\n"
+		" -o .. write output to here instead of stdout. One of:\n"
+		"         tcp:HOST:PORT           connect to a TCP server\n"
+		"         tcp-listen:[HOST:]PORT  wait for one TCP connection\n"
+		"         unix:PATH               connect to a Unix socket\n"
+		"         unix-listen:PATH        wait for one Unix socket connection\n"
+		"         a file name, or '-' for stdin/stdout\n"
+		" -B .. Socket receive/send buffer size in bytes\n"
+		" -Z    Do not use zerocopy sends to TCP. By default these are used\n"
+		"       for blocksizes of 16k and up.\n"
+		" -r .. Keep records intact: a size in bytes for fixed size records,\n"
+		"       or 'length' for records that start with a 32-bit big-endian\n"
+		"       length. Only whole records go into the hardware, as many per\n"
+		"       write as there are. The blocksize is rounded up to a whole\n"
+		"       number of records. At exit, the time from a record's arrival\n"
+		"       to the output is reported, assuming the pipeline returns one\n"
+		"       record for each record in, framed the same way.\n"
+		" -m .. Publish live counters in shared memory /dev/shm/name, read\n"
+		"       them with datraproxystat.\n"
+		"Example: mpg123 -s music.mp3 | " << name << " lowPass reverb | aplay -f cd\n"
+		"         " << name << " 'split(lowPass,highPass|gain)|mix'\n";
 }
 
 class ParseError: public std::exception
@@ -106,21 +149,178 @@ static int openAvailableFifo(datra::HardwareContext &context, unsigned char* id,
 	throw IOException(ENODEV);
 }
 
+/* Claims a free partition for the function and programs it. The config
+ * handle stays open, so the node remains ours while the proxy runs. */
+static int allocateFunction(datra::HardwareContext &context, datra::HardwareControl &control,
+	const char* function, bool verbose)
+{
+	unsigned int candidates = context.getAvailablePartitions(function);
+	if (candidates == 0)
+		throw NotFoundError("Function does not exist", function);
+	unsigned int mask = 1;
+	for (int id = 1; id < 32; ++id)
+	{
+		mask <<= 1;
+		if ((mask & candidates) != 0)
+		{
+			int handle = context.openConfig(id, O_RDWR);
+			if (handle == -1)
+			{
+				if (errno != EBUSY) /* Non existent? Bail out, last node */
+					break;
+			}
+			else
+			{
+				control.disableNode(id);
+				std::string filename = context.findPartition(function, id);
+				control.program(filename.c_str());
+				control.enableNode(id);
+				if (verbose)
+					std::cerr << function << " handle=" << handle << " id=" << id << std::endl;
+				return id;
+			}
+		}
+	}
+	throw NotFoundError("Function not available", function);
+}
+
+struct FifoPort
+{
+	unsigned char node;
+	unsigned char fifo;
+};
+
+/* Allocates the functions of a pipeline graph and collects the routes
+ * between them. */
+class GraphBuilder
+{
+	datra::HardwareContext &context;
+	datra::HardwareControl &control;
+	const PipelineGraph &graph;
+	bool verbose;
+
+	void connect(const FifoPort &from, const FifoPort &to)
+	{
+		datra::HardwareControl::Route route;
+		route.srcNode = from.node;
+		route.srcFifo = from.fifo;
+		route.dstNode = to.node;
+		route.dstFifo = to.fifo;
+		if (verbose)
+			std::cerr << "Route "
+				<< (int)route.srcNode << "." << (int)route.srcFifo
+				<< "->"
+				<< (int)route.dstNode << "." << (int)route.dstFifo
+				<< std::endl;
+		routes.push_back(route);
+	}
+public:
+	std::vector<datra::HardwareControl::Route> routes;
+
+	GraphBuilder(datra::HardwareContext &ctx, datra::HardwareControl &ctl,
+			const PipelineGraph &g, bool verbose_mode):
+		context(ctx),
+		control(ctl),
+		graph(g),
+		verbose(verbose_mode)
+	{
+	}
+
+	/* Feeds 'sources' into the pipeline, returns the fifos its output
+	 * comes out of: one, unless it ends with a split. */
+	std::vector<FifoPort> build(unsigned int pipeline, std::vector<FifoPort> sources)
+	{
+		const GraphPipeline& stages = graph.pipelines[pipeline];
+		for (unsigned int i = 0; i < stages.size(); ++i)
+		{
+			const GraphStage& stage = stages[i];
+			if (stage.branches.empty())
+			{
+				FifoPort port;
+				port.node = allocateFunction(context, control, stage.function.c_str(), verbose);
+				for (unsigned int k = 0; k < sources.size(); ++k)
+				{
+					port.fifo = k;
+					connect(sources[k], port);
+				}
+				/* A split after this takes one output fifo per branch */
+				unsigned int outputs = (i + 1 < stages.size()) ? graph.stage_inputs(stages[i + 1]) : 1;
+				sources.clear();
+				for (unsigned int k = 0; k < outputs; ++k)
+				{
+					port.fifo = k;
+					sources.push_back(port);
+				}
+			}
+			else
+			{
+				std::vector<FifoPort> outputs;
+				unsigned int next = 0;
+				for (unsigned int b = 0; b < stage.branches.size(); ++b)
+				{
+					unsigned int n = graph.inputs(stage.branches[b]);
+					std::vector<FifoPort> branch_out = build(stage.branches[b],
+						std::vector<FifoPort>(sources.begin() + next, sources.begin() + next + n));
+					next += n;
+					outputs.insert(outputs.end(), branch_out.begin(), branch_out.end());
+				}
+				sources = outputs;
+			}
+		}
+		return sources;
+	}
+};
+
+/* Fifos from the CPU into the hardware, one per input of the graph */
+class FifoSet
+{
+	FifoSet(const FifoSet&);
+	FifoSet& operator=(const FifoSet&);
+public:
+	std::vector<int> handles;
 
-int main(int argc, char** argv)
+	FifoSet()
+	{
+	}
+
+	~FifoSet()
+	{
+		for (unsigned int i = 0; i < handles.size(); ++i)
+			::close(handles[i]);
+	}
+};
+
+int DATRA_MAIN(datraproxy)(int argc, char** argv)
 {
 	static struct option long_options[] = {
+	   {"autotune",	required_argument, 0, 'A' },
+	   {"input",	required_argument, 0, 'i' },
+	   {"output",	required_argument, 0, 'o' },
+	   {"records",	required_argument, 0, 'r' },
+	   {"sockbuf",	required_argument, 0, 'B' },
+	   {"no-zerocopy",	no_argument, 0, 'Z' },
+	   {"stats",	required_argument, 0, 'm' },
 	   {"verbose",	no_argument, 0, 'v' },
 	   {0,          0,           0, 0 }
 	};
 	unsigned int blocksize = 4096;
 	bool verbose = false;
+	const char* stats_name = NULL;
+	const char* input_name = "-";
+	const char* output_name = "-";
+	FramingMode framing = FRAMING_NONE;
+	unsigned int record_size = 0;
+	AutotuneGoal autotune = AUTOTUNE_OFF;
+	uint64_t latency_target = 0;
+	EndpointOptions endpoint_options;
+	endpoint_options.buffer_size = 0;
+	endpoint_options.zerocopy = true;
 	try
 	{
 		int option_index = 0;
 		for (;;)
 		{
-			int c = getopt_long(argc, argv, "bns:v",
+			int c = getopt_long(argc, argv, "A:bB:i:m:no:r:s:vZ",
 							long_options, &option_index);
 			if (c < 0)
 				break;
@@ -131,6 +331,37 @@ int main(int argc, char** argv)
 				if (blocksize <= 0)
 					throw ParseError("Invalid blocksize", optarg);
 				break;
+			case 'A':
+				if (!parse_autotune(optarg, &autotune, &latency_target))
+					throw ParseError("Invalid autotune goal", optarg);
+				break;
+			case 'B':
+				endpoint_options.buffer_size = atoi(optarg);
+				break;
+			case 'i':
+				input_name = optarg;
+				break;
+			case 'm':
+				stats_name = optarg;
+				break;
+			case 'o':
+				output_name = optarg;
+				break;
+			case 'r':
+				if (strcmp(optarg, "length") == 0)
+					framing = FRAMING_LENGTH;
+				else
+				{
+					int size = atoi(optarg);
+					if (size <= 0)
+						throw ParseError("Invalid record size", optarg);
+					framing = FRAMING_FIXED;
+					record_size = size;
+				}
+				break;
+			case 'Z':
+				endpoint_options.zerocopy = false;
+				break;
 			case 'v':
 				verbose = true;
 				break;
@@ -144,196 +375,373 @@ int main(int argc, char** argv)
 			usage(argv[0]);
 			return 1;
 		}
+		if (framing == FRAMING_FIXED && blocksize % record_size)
+			blocksize += record_size - blocksize % record_size;
+		/* Buffers are sized for the largest block the tuner may pick */
+		const unsigned int granularity = (framing == FRAMING_FIXED) ? record_size : 1;
+		unsigned int largest = blocksize;
+		if (autotune != AUTOTUNE_OFF)
+		{
+			largest = AUTOTUNE_MAX_BLOCKSIZE;
+			if (largest % granularity)
+				largest += granularity - largest % granularity;
+		}
+		BlockSizeTuner tuner(autotune, latency_target, blocksize,
+			AUTOTUNE_MIN_BLOCKSIZE > granularity ? AUTOTUNE_MIN_BLOCKSIZE : granularity,
+			largest, granularity);
+		if (autotune != AUTOTUNE_OFF)
+			blocksize = tuner.size;
+		/* Connect first, no point in claiming hardware if that fails */
+		endpoint_options.verbose = verbose;
+		if (blocksize < ZEROCOPY_MIN_BLOCKSIZE)
+			endpoint_options.zerocopy = false;
+		StreamEndpoint input_endpoint = open_endpoint(input_name, O_RDONLY, endpoint_options);
+		datra::File input(input_endpoint.fd);
+		StreamEndpoint output_endpoint = open_endpoint(output_name, O_WRONLY, endpoint_options);
+		datra::File output(output_endpoint.fd);
 		datra::HardwareContext context;
 		datra::HardwareControl control(context);
-		std::vector<datra::HardwareControl::Route> routes;
-		datra::HardwareControl::Route route;
-		/* entry route */
-		route.srcNode = 0;
-		datra::File to_hardware(openAvailableFifo(context, &route.srcFifo, O_WRONLY));
-		datra::set_non_blocking(to_hardware);
-		/* Set up hardware resources and routes */
+		std::string description;
 		for (; optind < argc; ++optind)
 		{
-			// ... open node, program ...
-			unsigned int candidates = context.getAvailablePartitions(argv[optind]);
-			if (candidates == 0)
-				throw NotFoundError("Function does not exist", argv[optind]);
-			unsigned int mask = 1;
-			for (int id = 1; id < 32; ++id)
-			{
-				mask <<= 1;
-				if ((mask & candidates) != 0)
-				{
-					int handle = context.openConfig(id, O_RDWR);
-					if (handle == -1)
-					{
-						if (errno != EBUSY) /* Non existent? Bail out, last node */
-							throw NotFoundError("Function not available", argv[optind]);
-					}
-					else
-					{
-						control.disableNode(id);
-						std::string filename =
-                                                                context.findPartition(argv[optind], id);
-                                                control.program(filename.c_str());
-						control.enableNode(id);
-						route.dstNode = id;
-						route.dstFifo = 0;
-						if (verbose)
-							std::cerr << argv[optind]
-								<< " handle=" << handle << " id=" << id
-								<< " "
-								<< (int)route.srcNode << "." << (int)route.srcFifo
-								<< "->"
-								<< (int)route.dstNode << "." << (int)route.dstFifo
-								<< std::endl;
-						routes.push_back(route);
-						route.srcNode = route.dstNode;
-						route.srcFifo = route.dstFifo;
-						break;
-					}
-				}
-			}
+			if (!description.empty())
+				description += '|';
+			description += argv[optind];
 		}
-		/* Setup routes from hw to sw */
-		route.dstNode = 0;
-		datra::File from_hardware(openAvailableFifo(context, &route.dstFifo, O_RDONLY));
+		PipelineGraph graph(description);
+		if (graph.outputs(0) != 1)
+			throw std::runtime_error("A split at the end of the pipeline needs a function to merge its branches");
+		/* Entry routes, the graph may need more than one input */
+		std::vector<FifoPort> sources;
+		FifoSet to_hardware;
+		for (unsigned int i = 0; i < graph.inputs(0); ++i)
+		{
+			FifoPort port;
+			port.node = 0;
+			int handle = openAvailableFifo(context, &port.fifo, O_WRONLY);
+			to_hardware.handles.push_back(handle);
+			datra::set_non_blocking(handle);
+			sources.push_back(port);
+		}
+		/* Set up hardware resources and routes */
+		GraphBuilder builder(context, control, graph, verbose);
+		std::vector<FifoPort> outputs = builder.build(0, sources);
+		/* Setup route from hw to sw */
+		FifoPort exit_port;
+		exit_port.node = 0;
+		datra::File from_hardware(openAvailableFifo(context, &exit_port.fifo, O_RDONLY));
 		datra::set_non_blocking(from_hardware);
-		routes.push_back(route);
+		std::vector<datra::HardwareControl::Route>& routes = builder.routes;
+		{
+			datra::HardwareControl::Route route;
+			route.srcNode = outputs[0].node;
+			route.srcFifo = outputs[0].fifo;
+			route.dstNode = exit_port.node;
+			route.dstFifo = exit_port.fifo;
+			routes.push_back(route);
+		}
 		/* Send route table to driver */
 		control.routeAdd(&routes[0], routes.size());
+		ProxyStats stats;
+		if (stats_name)
+		{
+			std::ostringstream table;
+			for (unsigned int i = 0; i < routes.size(); ++i)
+				table << (i ? " " : "")
+					<< (int)routes[i].srcNode << "." << (int)routes[i].srcFifo
+					<< "->"
+					<< (int)routes[i].dstNode << "." << (int)routes[i].dstFifo;
+			stats.open(stats_name, description, table.str());
+			stats.counters.blocksize = blocksize;
+			stats.publish();
+		}
 		/* Run the transfer loop */
-		std::vector<char> buffer_in(blocksize);
-		std::vector<char> buffer_out(blocksize);
-		char* in_pos;
-		ssize_t in_avail = 0;
+		/* With zerocopy, a buffer cannot be refilled until the kernel
+		 * is done sending it, so the output rotates over several. */
+		const bool zerocopy = output_endpoint.zerocopy;
+		ZeroCopySender sender(output);
+		const unsigned int out_slots = zerocopy ? ZEROCOPY_BUFFERS : 1;
+		unsigned int out_slot = 0;
+		std::vector<uint32_t> slot_send_id(out_slots);
+		std::vector<bool> slot_in_flight(out_slots, false);
+		std::vector<char> buffer_out(largest * out_slots);
+		/* Input collects in a ring, each fifo into the hardware has its
+		 * own position in it. A fifo is only given whole records, up to
+		 * the last complete one, which may be many in one writev. */
+		ByteRing ring(largest * INPUT_BLOCKS);
+		RecordFramer in_records(framing, record_size, ring.capacity);
+		RecordFramer out_records(framing, record_size, ~(size_t)0);
+		const unsigned int n_to_hardware = to_hardware.handles.size();
+		std::vector<uint64_t> in_tail(n_to_hardware, 0);
+		/* Arrival times of records not yet seen on the output, with the
+		 * number of records that arrived at that time */
+		std::deque<std::pair<uint64_t, unsigned int> > in_flight;
+		Histogram latency;
+		uint64_t records_in = 0;
+		uint64_t records_out = 0;
+		RateMeter throughput;
+		uint64_t tune_next = monotonic_ns() + AUTOTUNE_INTERVAL_NS;
+		uint64_t tune_latency_sum = 0;
+		uint64_t tune_latency_count = 0;
 		char* out_pos;
 		ssize_t out_avail = 0;
-		datra::set_non_blocking(0);
-		datra::set_non_blocking(1);
-		struct pollfd fds[4];
-		fds[0].fd = 0;
-		fds[1].fd = to_hardware;
-		fds[2].fd = from_hardware;
-		fds[3].fd = 1;
+		datra::set_non_blocking(input);
+		datra::set_non_blocking(output);
+		const unsigned int from_index = n_to_hardware + 1;
+		const unsigned int output_index = n_to_hardware + 2;
+		std::vector<struct pollfd> fds(n_to_hardware + 3);
+		for (unsigned int i = 0; i < n_to_hardware; ++i)
+			fds[1 + i].fd = to_hardware.handles[i];
+		fds[from_index].fd = from_hardware;
+		fds[output_index].fd = output;
 		bool input_eof = false;
 		for (;;)
 		{
-			if (in_avail)
+			uint64_t in_oldest = ring.head;
+			for (unsigned int i = 0; i < n_to_hardware; ++i)
 			{
-				fds[0].events = 0;
-				fds[1].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
-			}
-			else
-			{
-				fds[0].events = input_eof ? 0 : POLLIN | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL;
-				fds[1].events = 0;
+				if (in_tail[i] < in_oldest)
+					in_oldest = in_tail[i];
+				fds[1 + i].events = (in_tail[i] < in_records.boundary) ? POLLOUT | POLLERR | POLLHUP | POLLNVAL : 0;
 			}
+			/* With the ring full, leave the input out entirely, a hangup
+			 * would otherwise wake us without anything to do */
+			/* Less queued input for smaller blocks, but a record larger
+			 * than that still has to fit */
+			size_t in_limit = (size_t)blocksize * INPUT_BLOCKS;
+			if (ring.head - in_records.boundary >= in_limit)
+				in_limit = ring.capacity;
+			bool in_room = (ring.head - in_oldest < in_limit);
+			fds[0].fd = in_room ? (int)input : -1;
+			fds[0].events = input_eof ? 0 : POLLIN | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL;
 			if (out_avail)
 			{
-				fds[2].events = 0;
-				fds[3].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
+				fds[from_index].events = 0;
+				fds[output_index].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
 			}
 			else
 			{
-				fds[2].events = POLLIN | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL;
-				fds[3].events = 0;
+				bool slot_free = !slot_in_flight[out_slot] ||
+					sender.is_complete(slot_send_id[out_slot]);
+				/* When it isn't, POLLERR on the output reports progress */
+				fds[from_index].events = slot_free ? POLLIN | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL : 0;
+				fds[output_index].events = 0;
 			}
 			int result;
 			if (input_eof)
-				result = ::poll(fds + 1, 3, 500);
+				result = ::poll(&fds[1], fds.size() - 1, 500);
 			else
-				result = ::poll(fds, 4, -1);
+				result = ::poll(&fds[0], fds.size(), -1);
+			DATRA_PROBE1(datraproxy, poll_wake, result);
 			if (result == -1)
 				throw IOException("poll");
+			++stats.counters.polls;
 			if (result == 0)
 			{
 				if (input_eof)
 				{
 					if (verbose)
-						std::cerr << "Timeout after EOF in stdin" << std::endl;
+						std::cerr << "Timeout after EOF in input" << std::endl;
 					break;
 				}
 			}
-			if (in_avail)
+			short output_ready = fds[output_index].revents;
+			if (zerocopy && (output_ready & POLLERR))
+			{
+				sender.reap();
+				output_ready &= ~POLLERR;
+			}
+			for (unsigned int i = 0; i < n_to_hardware; ++i)
 			{
-				if (fds[1].revents)
+				if (!fds[1 + i].revents)
+					continue;
+				fds[1 + i].revents = 0;
+				struct iovec iov[2];
+				int n = ring.iov(in_tail[i], in_records.boundary, iov);
+				if (!n)
+					continue;
+				ssize_t bytes = ::writev(to_hardware.handles[i], iov, n);
+				DATRA_PROBE2(datraproxy, write, PROXYSTATS_TO_HARDWARE, bytes);
+				if (bytes <= 0)
 				{
-					ssize_t bytes = ::write(to_hardware, in_pos, in_avail);
-					if (bytes <= 0)
-					{
-						if (bytes == 0)
-							throw datra::EndOfOutputException();
-						else if (errno != EAGAIN)
-							throw IOException("to hardware");
-					}
+					if (bytes == 0)
+						throw datra::EndOfOutputException();
+					else if (errno != EAGAIN)
+						throw IOException("to hardware");
 					else
-					{
-						in_avail -= bytes;
-						in_pos += bytes;
-					}
+						++stats.counters.eagain[PROXYSTATS_TO_HARDWARE];
 				}
-				fds[1].revents = 0;
+				else
+					in_tail[i] += bytes;
 			}
-			else
+			if (fds[0].revents)
 			{
-				if (fds[0].revents)
+				fds[0].revents = 0;
+				/* The writes above may have made more room */
+				in_oldest = ring.head;
+				for (unsigned int i = 0; i < n_to_hardware; ++i)
+					if (in_tail[i] < in_oldest)
+						in_oldest = in_tail[i];
+				size_t room = in_limit - (ring.head - in_oldest);
+				if (room > blocksize)
+					room = blocksize;
+				struct iovec iov[2];
+				int n = ring.iov(ring.head, ring.head + room, iov);
+				ssize_t bytes = ::readv(input, iov, n);
+				DATRA_PROBE2(datraproxy, read, PROXYSTATS_INPUT, bytes);
+				if (bytes <= 0)
 				{
-					in_pos = &buffer_in[0];
-					ssize_t bytes = ::read(0, in_pos, blocksize);
-					if (bytes <= 0)
+					if (bytes == 0)
 					{
-						if (bytes == 0)
+						if (verbose)
+							std::cerr << "EOF on input" << std::endl;
+						input_eof = true;
+						if (in_records.boundary != ring.head)
 						{
-							if (verbose)
-								std::cerr << "EOF on stdin" << std::endl;
-							input_eof = true;
+							std::cerr << "Input ends with an incomplete record of "
+								<< (ring.head - in_records.boundary) << " bytes, sending it anyway" << std::endl;
+							in_records.boundary = ring.head;
 						}
-						else if (errno != EAGAIN)
-							throw IOException("to hardware");
 					}
+					else if (errno != EAGAIN)
+						throw IOException("from input");
 					else
-						in_avail = bytes;
-					fds[0].revents = 0;
+						++stats.counters.eagain[PROXYSTATS_INPUT];
+				}
+				else
+				{
+					unsigned int records = 0;
+					size_t left = bytes;
+					for (int k = 0; k < n && left; ++k)
+					{
+						size_t piece = (left < iov[k].iov_len) ? left : iov[k].iov_len;
+						records += in_records.scan((const char*)iov[k].iov_base, ring.head, piece);
+						ring.head += piece;
+						left -= piece;
+					}
+					if (records)
+					{
+						in_flight.push_back(std::make_pair(monotonic_ns(), records));
+						records_in += records;
+					}
+					stats.counters.bytes_in += bytes;
+					++stats.counters.blocks_in;
 				}
 			}
 			if (out_avail)
 			{
-				if (fds[3].revents)
+				if (output_ready)
 				{
-					ssize_t bytes = ::write(1, out_pos, out_avail);
+					ssize_t bytes;
+					if (zerocopy)
+					{
+						bytes = sender.send(out_pos, out_avail, &slot_send_id[out_slot]);
+						if (bytes > 0)
+							slot_in_flight[out_slot] = true;
+					}
+					else if (output_endpoint.is_socket)
+						bytes = ::send(output, out_pos, out_avail, MSG_NOSIGNAL);
+					else
+						bytes = ::write(output, out_pos, out_avail);
+					DATRA_PROBE2(datraproxy, write, PROXYSTATS_OUTPUT, bytes);
 					if (bytes <= 0)
 					{
 						if (bytes == 0)
 							throw datra::EndOfOutputException();
 						else if (errno != EAGAIN)
-							throw IOException("to stdout");
+							throw IOException("to output");
+						else
+							++stats.counters.eagain[PROXYSTATS_OUTPUT];
 					}
 					else
 					{
+						unsigned int records = out_records.scan(out_pos, stats.counters.bytes_out, bytes);
+						if (records)
+						{
+							uint64_t now = monotonic_ns();
+							records_out += records;
+							for (; records && !in_flight.empty(); --records)
+							{
+								latency.record(now - in_flight.front().first);
+								if (--in_flight.front().second == 0)
+									in_flight.pop_front();
+							}
+						}
 						out_avail -= bytes;
 						out_pos += bytes;
+						stats.counters.bytes_out += bytes;
+						throughput.add(bytes);
+						if (!out_avail)
+							out_slot = (out_slot + 1) % out_slots;
 					}
-					fds[3].revents = 0;
+					fds[output_index].revents = 0;
 				}
 			}
 			else
 			{
-				if (fds[2].revents)
+				if (fds[from_index].revents)
 				{
-					out_pos = &buffer_out[0];
+					out_pos = &buffer_out[out_slot * largest];
 					ssize_t bytes = ::read(from_hardware, out_pos, blocksize);
+					DATRA_PROBE2(datraproxy, read, PROXYSTATS_FROM_HARDWARE, bytes);
 					if (bytes < 0)
 					{
 						if (errno != EAGAIN)
 							throw IOException("from hardware");
+						else
+							++stats.counters.eagain[PROXYSTATS_FROM_HARDWARE];
 					}
 					else
+					{
 						out_avail = bytes;
-					fds[2].revents = 0;
+						if (bytes)
+							++stats.counters.blocks_out;
+					}
+					fds[from_index].revents = 0;
 				}
 			}
+			if (autotune != AUTOTUNE_OFF && monotonic_ns() >= tune_next)
+			{
+				double rate = throughput.interval_rate();
+				uint64_t delay;
+				if (latency.total > tune_latency_count)
+					delay = (latency.sum - tune_latency_sum) / (latency.total - tune_latency_count);
+				else
+				{
+					/* Little's law, for streams without records */
+					uint64_t in_proxy = stats.counters.bytes_in > stats.counters.bytes_out ?
+						stats.counters.bytes_in - stats.counters.bytes_out : 0;
+					delay = (rate > 0.0) ? (uint64_t)(in_proxy * 1e9 / rate) : 0;
+				}
+				tune_latency_sum = latency.sum;
+				tune_latency_count = latency.total;
+				bool was_settled = tuner.settled;
+				if (tuner.update(rate, delay) && verbose)
+					std::cerr << "Blocksize " << blocksize << " -> " << tuner.size
+						<< " at " << (uint64_t)rate << " bytes/s, latency "
+						<< delay / 1000 << " us" << std::endl;
+				if (tuner.settled && !was_settled)
+					std::cerr << "Blocksize settled at " << tuner.size << " bytes" << std::endl;
+				blocksize = tuner.size;
+				stats.counters.blocksize = blocksize;
+				tune_next = monotonic_ns() + AUTOTUNE_INTERVAL_NS;
+			}
+			if (stats.enabled())
+			{
+				stats.counters.pending_in = ring.head - in_oldest;
+				stats.counters.pending_out = out_avail;
+				stats.counters.input_eof = input_eof;
+				stats.publish();
+			}
+		}
+		if (framing != FRAMING_NONE)
+		{
+			MetricsReporter report(stderr);
+			MetricsRow row;
+			row.add("records_in", records_in)
+				.add("records_out", records_out)
+				.add("latency_ns", latency);
+			report.emit(row);
 		}
 	}
 	catch (const std::exception& ex)
@@ -0,0 +1,311 @@
+/*
+ * datraproxystat.cpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <dirent.h>
+#include <iostream>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include "multicall.hpp"
+#include "proxystats.hpp"
+
+static void usage(const char* name)
+{
+	std::cerr << "usage: " << name << " [-p] [-i seconds] [name ...]\n"
+		" -p    Prometheus text exposition format\n"
+		" -i #  Repeat every # seconds\n"
+		" name  Shared memory segment given to datraproxy -m. Without names,\n"
+		"       all datraproxy segments in /dev/shm are shown.\n"
+		"Shows the live counters of running datraproxy instances.\n";
+}
+
+struct Snapshot
+{
+	std::string name;
+	const ProxyStatsSegment* segment;
+	ProxyCounters counters;
+	bool consistent;
+	bool alive;
+};
+
+static void find_segments(std::vector<std::string>* names)
+{
+	DIR* dir = opendir("/dev/shm");
+	if (dir == NULL)
+		throw datra::IOException("/dev/shm");
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+		try
+		{
+			ProxyStatsView view(entry->d_name);
+			names->push_back(entry->d_name);
+		}
+		catch (const std::exception&)
+		{
+			/* Not ours */
+		}
+	}
+	closedir(dir);
+}
+
+static void take_snapshot(const ProxyStatsView& view, Snapshot* s)
+{
+	s->segment = view.segment;
+	s->consistent = view.read(&s->counters);
+	s->alive = (kill(view.segment->pid, 0) == 0 || errno == EPERM);
+}
+
+static void print_text(const Snapshot& s)
+{
+	const ProxyCounters& c = s.counters;
+	printf("%s: pid %d%s, pipeline \"%s\"\n",
+		s.name.c_str(), s.segment->pid, s.alive ? "" : " (gone)", s.segment->pipeline);
+	printf("  routes    %s\n", s.segment->routes);
+	if (!s.consistent)
+	{
+		printf("  counters  locked, writer stopped during an update\n");
+		return;
+	}
+	printf("  bytes     in=%llu out=%llu\n",
+		(unsigned long long)c.bytes_in, (unsigned long long)c.bytes_out);
+	printf("  blocks    in=%llu out=%llu blocksize=%u\n",
+		(unsigned long long)c.blocks_in, (unsigned long long)c.blocks_out, c.blocksize);
+	printf("  pending   in=%u out=%u%s\n", c.pending_in, c.pending_out,
+		c.input_eof ? " (input at EOF)" : "");
+	printf("  polls     %llu\n", (unsigned long long)c.polls);
+	printf("  eagain   ");
+	for (unsigned int i = 0; i < PROXYSTATS_CHANNELS; ++i)
+		printf(" %s=%llu", proxystats_channel_names[i], (unsigned long long)c.eagain[i]);
+	printf("\n");
+}
+
+/* Label values may not contain raw quotes, backslashes or newlines */
+static std::string prometheus_escape(const char* text)
+{
+	std::string result;
+	for (; *text; ++text)
+	{
+		if (*text == '"' || *text == '\\')
+			result += '\\';
+		if (*text == '\n')
+			result += "\\n";
+		else
+			result += *text;
+	}
+	return result;
+}
+
+static void prometheus_labels(const Snapshot& s, const char* extra_name = NULL, const char* extra_value = NULL)
+{
+	printf("{segment=\"%s\",pid=\"%d\",pipeline=\"%s\"",
+		prometheus_escape(s.name.c_str()).c_str(), s.segment->pid,
+		prometheus_escape(s.segment->pipeline).c_str());
+	if (extra_name)
+		printf(",%s=\"%s\"", extra_name, extra_value);
+	printf("}");
+}
+
+static void prometheus_header(const char* metric, const char* type, const char* help)
+{
+	printf("# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+}
+
+static void print_prometheus(const std::vector<Snapshot>& snapshots)
+{
+	prometheus_header("datraproxy_up", "gauge", "Whether the proxy process is still running");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		printf("datraproxy_up");
+		prometheus_labels(snapshots[i]);
+		printf(" %d\n", snapshots[i].alive ? 1 : 0);
+	}
+	prometheus_header("datraproxy_start_time_seconds", "gauge", "Start time of the proxy since the epoch");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		printf("datraproxy_start_time_seconds");
+		prometheus_labels(snapshots[i]);
+		printf(" %llu\n", (unsigned long long)snapshots[i].segment->start_time);
+	}
+	prometheus_header("datraproxy_bytes_total", "counter", "Bytes read from the input and written to the output");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		if (!snapshots[i].consistent)
+			continue;
+		printf("datraproxy_bytes_total");
+		prometheus_labels(snapshots[i], "direction", "in");
+		printf(" %llu\n", (unsigned long long)snapshots[i].counters.bytes_in);
+		printf("datraproxy_bytes_total");
+		prometheus_labels(snapshots[i], "direction", "out");
+		printf(" %llu\n", (unsigned long long)snapshots[i].counters.bytes_out);
+	}
+	prometheus_header("datraproxy_blocks_total", "counter", "Blocks read from the input and from the hardware");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		if (!snapshots[i].consistent)
+			continue;
+		printf("datraproxy_blocks_total");
+		prometheus_labels(snapshots[i], "direction", "in");
+		printf(" %llu\n", (unsigned long long)snapshots[i].counters.blocks_in);
+		printf("datraproxy_blocks_total");
+		prometheus_labels(snapshots[i], "direction", "out");
+		printf(" %llu\n", (unsigned long long)snapshots[i].counters.blocks_out);
+	}
+	prometheus_header("datraproxy_polls_total", "counter", "Wakeups of the transfer loop");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		if (!snapshots[i].consistent)
+			continue;
+		printf("datraproxy_polls_total");
+		prometheus_labels(snapshots[i]);
+		printf(" %llu\n", (unsigned long long)snapshots[i].counters.polls);
+	}
+	prometheus_header("datraproxy_eagain_total", "counter", "Transfers that would have blocked, per channel");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		if (!snapshots[i].consistent)
+			continue;
+		for (unsigned int ch = 0; ch < PROXYSTATS_CHANNELS; ++ch)
+		{
+			printf("datraproxy_eagain_total");
+			prometheus_labels(snapshots[i], "channel", proxystats_channel_names[ch]);
+			printf(" %llu\n", (unsigned long long)snapshots[i].counters.eagain[ch]);
+		}
+	}
+	prometheus_header("datraproxy_pending_bytes", "gauge", "Bytes buffered in the proxy, waiting for the next stage");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		if (!snapshots[i].consistent)
+			continue;
+		printf("datraproxy_pending_bytes");
+		prometheus_labels(snapshots[i], "direction", "in");
+		printf(" %u\n", snapshots[i].counters.pending_in);
+		printf("datraproxy_pending_bytes");
+		prometheus_labels(snapshots[i], "direction", "out");
+		printf(" %u\n", snapshots[i].counters.pending_out);
+	}
+	prometheus_header("datraproxy_blocksize_bytes", "gauge", "Transfer size");
+	for (unsigned int i = 0; i < snapshots.size(); ++i)
+	{
+		if (!snapshots[i].consistent)
+			continue;
+		printf("datraproxy_blocksize_bytes");
+		prometheus_labels(snapshots[i]);
+		printf(" %u\n", snapshots[i].counters.blocksize);
+	}
+}
+
+int DATRA_MAIN(datraproxystat)(int argc, char** argv)
+{
+	static struct option long_options[] = {
+	   {"interval",	required_argument, 0, 'i' },
+	   {"prometheus",	no_argument, 0, 'p' },
+	   {0,          0,           0, 0 }
+	};
+	bool prometheus = false;
+	unsigned int interval = 0;
+	try
+	{
+		int option_index = 0;
+		for (;;)
+		{
+			int c = getopt_long(argc, argv, "i:p",
+							long_options, &option_index);
+			if (c < 0)
+				break;
+			switch (c)
+			{
+			case 'i':
+				interval = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				prometheus = true;
+				break;
+			case '?':
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		std::vector<std::string> names;
+		for (; optind < argc; ++optind)
+			names.push_back(argv[optind]);
+		const bool scan = names.empty();
+		for (;;)
+		{
+			if (scan)
+			{
+				names.clear();
+				find_segments(&names);
+			}
+			/* Map everything first, so all snapshots are taken close
+			 * together. Segments found by scanning may vanish meanwhile. */
+			std::vector<ProxyStatsView*> views;
+			std::vector<Snapshot> snapshots;
+			for (unsigned int i = 0; i < names.size(); ++i)
+			{
+				try
+				{
+					views.push_back(new ProxyStatsView(names[i].c_str()));
+				}
+				catch (const std::exception&)
+				{
+					if (scan)
+						continue;
+					for (unsigned int j = 0; j < views.size(); ++j)
+						delete views[j];
+					throw;
+				}
+				snapshots.push_back(Snapshot());
+				snapshots.back().name = names[i];
+			}
+			for (unsigned int i = 0; i < views.size(); ++i)
+				take_snapshot(*views[i], &snapshots[i]);
+			if (prometheus)
+				print_prometheus(snapshots);
+			else
+				for (unsigned int i = 0; i < snapshots.size(); ++i)
+					print_text(snapshots[i]);
+			fflush(stdout);
+			for (unsigned int i = 0; i < views.size(); ++i)
+				delete views[i];
+			if (!interval)
+				break;
+			sleep(interval);
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "ERROR:\n" << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
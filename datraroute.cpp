@@ -31,6 +31,8 @@
 #include <getopt.h>
 #include <vector>
 #include <sstream>
+#include "multicall.hpp"
+#include "tracepoints.hpp"
 
 static void usage(const char* name)
 {
@@ -105,7 +107,7 @@ static datra::HardwareControl::Route parse_route(const char *txt)
 }
 
 
-int main(int argc, char** argv)
+int DATRA_MAIN(datraroute)(int argc, char** argv)
 {
 	static struct option long_options[] = {
 	   {"clear",	no_argument, 0, 'c' },
@@ -128,7 +130,9 @@ int main(int argc, char** argv)
 			switch (c)
 			{
 			case 'c':
+				DATRA_PROBE(datraroute, route_delete_all);
 				datra::HardwareControl(context).routeDeleteAll();
+				DATRA_PROBE(datraroute, route_delete_all_done);
 				break;
 			case 'l':
 				list_routes = true;
@@ -136,7 +140,9 @@ int main(int argc, char** argv)
 			case 'n':
 				{
 					int node = atoi(optarg);
+					DATRA_PROBE1(datraroute, route_delete, node);
 					datra::HardwareControl(context).routeDelete(node);
+					DATRA_PROBE1(datraroute, route_delete_done, node);
 				}
 				break;
 			case 'v':
@@ -163,7 +169,9 @@ int main(int argc, char** argv)
 		}
 		if (!routes.empty())
 		{
+			DATRA_PROBE1(datraroute, route_add, routes.size());
 			datra::HardwareControl(context).routeAdd(&routes[0], routes.size());
+			DATRA_PROBE1(datraroute, route_add_done, routes.size());
 		}
 		if (list_routes)
 		{
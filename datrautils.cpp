@@ -0,0 +1,81 @@
+/*
+ * datrautils.cpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#include <string.h>
+#include <iostream>
+#include "multicall.hpp"
+
+struct Applet
+{
+	const char* name;
+	int (*main)(int argc, char** argv);
+};
+
+static const Applet applets[] = {
+	{ "datraaxiprobe", datraaxiprobe_main },
+	{ "datraboot", datraboot_main },
+	{ "datralicense", datralicense_main },
+	{ "datraprogrammer", datraprogrammer_main },
+	{ "datraproxy", datraproxy_main },
+	{ "datraproxystat", datraproxystat_main },
+	{ "datraroute", datraroute_main },
+};
+
+static const Applet* find_applet(const char* name)
+{
+	const char* slash = strrchr(name, '/');
+	if (slash)
+		name = slash + 1;
+	for (unsigned int i = 0; i < sizeof(applets)/sizeof(applets[0]); ++i)
+		if (strcmp(applets[i].name, name) == 0)
+			return &applets[i];
+	return NULL;
+}
+
+static void usage(const char* name)
+{
+	std::cerr << "usage: " << name << " tool [arguments]\n"
+		"Multi-call binary, runs the tool named by argv[0] (usually a\n"
+		"symlink) or by the first argument. Tools:\n";
+	for (unsigned int i = 0; i < sizeof(applets)/sizeof(applets[0]); ++i)
+		std::cerr << "  " << applets[i].name << "\n";
+}
+
+int main(int argc, char** argv)
+{
+	const Applet* applet = find_applet(argv[0]);
+	if (applet)
+		return applet->main(argc, argv);
+	if (argc > 1)
+	{
+		applet = find_applet(argv[1]);
+		if (applet)
+			return applet->main(argc - 1, argv + 1);
+	}
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,337 @@
+/*
+ * endpoints.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <datra/fileio.hpp>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#ifdef __linux__
+#	include <linux/errqueue.h>
+#endif
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#	define ENDPOINT_HAVE_ZEROCOPY 1
+#endif
+
+/* Below this, pinning pages and handling completions costs more than the
+ * copy it saves. */
+#define ZEROCOPY_MIN_BLOCKSIZE (16*1024)
+/* Output buffers to rotate over while sends are in flight */
+#define ZEROCOPY_BUFFERS 8
+
+/*
+ * Where datraproxy reads its input from or writes its output to:
+ *   -                      stdin or stdout
+ *   tcp:HOST:PORT          connect to a TCP server
+ *   tcp-listen:[HOST:]PORT accept one TCP connection
+ *   unix:PATH              connect to a Unix stream socket
+ *   unix-listen:PATH       accept one connection on a Unix stream socket
+ * Anything else is opened as a file.
+ */
+struct EndpointOptions
+{
+	int buffer_size; /* SO_RCVBUF/SO_SNDBUF, 0 leaves the default */
+	bool zerocopy;   /* Try MSG_ZEROCOPY on TCP output */
+	bool verbose;
+};
+
+struct StreamEndpoint
+{
+	int fd;
+	bool is_socket;
+	bool zerocopy; /* SO_ZEROCOPY was accepted by the socket */
+};
+
+class EndpointError: public std::runtime_error
+{
+public:
+	EndpointError(const std::string& spec, const char* what):
+		std::runtime_error(spec + ": " + what)
+	{
+	}
+};
+
+/* Splits "host:port" at the last colon, host may be empty */
+static inline void endpoint_split_host(const std::string& spec, const std::string& address,
+	std::string* host, std::string* port)
+{
+	std::string::size_type colon = address.rfind(':');
+	if (colon == std::string::npos)
+	{
+		host->clear();
+		*port = address;
+	}
+	else
+	{
+		*host = address.substr(0, colon);
+		*port = address.substr(colon + 1);
+	}
+	if (port->empty())
+		throw EndpointError(spec, "no port given");
+}
+
+static inline int endpoint_tcp(const std::string& spec, const std::string& address, bool listening)
+{
+	std::string host;
+	std::string port;
+	endpoint_split_host(spec, address, &host, &port);
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (listening)
+		hints.ai_flags = AI_PASSIVE;
+	struct addrinfo* addresses;
+	int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addresses);
+	if (err != 0)
+		throw EndpointError(spec, gai_strerror(err));
+	int fd = -1;
+	for (struct addrinfo* ai = addresses; ai != NULL; ai = ai->ai_next)
+	{
+		fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (listening)
+		{
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 1) == 0)
+				break;
+		}
+		else if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if (fd == -1)
+		throw EndpointError(spec, strerror(errno));
+	return fd;
+}
+
+static inline int endpoint_unix(const std::string& spec, const std::string& path, bool listening)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path))
+		throw EndpointError(spec, "invalid socket path");
+	strcpy(address.sun_path, path.c_str());
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		throw EndpointError(spec, strerror(errno));
+	int result;
+	if (listening)
+	{
+		::unlink(path.c_str());
+		result = ::bind(fd, (struct sockaddr*)&address, sizeof(address));
+		if (result == 0)
+			result = ::listen(fd, 1);
+	}
+	else
+		result = ::connect(fd, (struct sockaddr*)&address, sizeof(address));
+	if (result != 0)
+	{
+		int err = errno;
+		::close(fd);
+		throw EndpointError(spec, strerror(err));
+	}
+	return fd;
+}
+
+/* Blocks until a listening endpoint has its connection */
+static inline StreamEndpoint open_endpoint(const char* spec, int access, const EndpointOptions& options)
+{
+	const std::string text(spec);
+	StreamEndpoint result;
+	result.is_socket = false;
+	result.zerocopy = false;
+	if (text == "-")
+	{
+		result.fd = (access == O_RDONLY) ? 0 : 1;
+		return result;
+	}
+	bool listening = false;
+	int fd;
+	if (text.compare(0, 11, "tcp-listen:") == 0)
+	{
+		listening = true;
+		fd = endpoint_tcp(text, text.substr(11), true);
+	}
+	else if (text.compare(0, 4, "tcp:") == 0)
+		fd = endpoint_tcp(text, text.substr(4), false);
+	else if (text.compare(0, 12, "unix-listen:") == 0)
+	{
+		listening = true;
+		fd = endpoint_unix(text, text.substr(12), true);
+	}
+	else if (text.compare(0, 5, "unix:") == 0)
+		fd = endpoint_unix(text, text.substr(5), false);
+	else
+	{
+		result.fd = ::open(spec, access == O_RDONLY ? O_RDONLY : O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (result.fd == -1)
+			throw datra::IOException(spec);
+		return result;
+	}
+	if (listening)
+	{
+		if (options.verbose)
+			std::cerr << "Waiting for connection on " << spec << std::endl;
+		int connection = ::accept(fd, NULL, NULL);
+		int err = errno;
+		::close(fd);
+		if (text.compare(0, 12, "unix-listen:") == 0)
+			::unlink(text.c_str() + 12);
+		if (connection == -1)
+			throw EndpointError(text, strerror(err));
+		fd = connection;
+	}
+	result.fd = fd;
+	result.is_socket = true;
+	if (options.buffer_size > 0)
+	{
+		int option = (access == O_RDONLY) ? SO_RCVBUF : SO_SNDBUF;
+		if (setsockopt(fd, SOL_SOCKET, option, &options.buffer_size, sizeof(options.buffer_size)) != 0)
+		{
+			int err = errno;
+			::close(fd);
+			throw EndpointError(text, strerror(err));
+		}
+	}
+#ifdef ENDPOINT_HAVE_ZEROCOPY
+	/* Unix sockets do not do zerocopy, the kernel refuses the option */
+	if (options.zerocopy && access != O_RDONLY)
+	{
+		int one = 1;
+		result.zerocopy = (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0);
+		if (options.verbose)
+			std::cerr << spec << (result.zerocopy ? ": zerocopy sends" : ": no zerocopy support, copying") << std::endl;
+	}
+#endif
+	return result;
+}
+
+/*
+ * Bookkeeping for MSG_ZEROCOPY sends. The kernel numbers each zerocopy
+ * send on a socket and reports completed ranges on the error queue
+ * (which raises POLLERR). Until a send is complete, the pages it came
+ * from must not be touched, so the caller keeps several buffers and
+ * asks before refilling one whether the last send from it has finished.
+ */
+class ZeroCopySender
+{
+	int fd;
+	uint32_t sent;      /* zerocopy sends issued */
+	uint32_t completed; /* sends the kernel has released */
+public:
+	bool copied; /* kernel fell back to copying, e.g. on loopback */
+
+	ZeroCopySender(int socket_fd):
+		fd(socket_fd),
+		sent(0),
+		completed(0),
+		copied(false)
+	{
+	}
+
+	/* Like send(), the returned id is what is_complete() takes */
+	ssize_t send(const void* data, size_t size, uint32_t* id)
+	{
+#ifdef ENDPOINT_HAVE_ZEROCOPY
+		ssize_t bytes = ::send(fd, data, size, MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if (bytes > 0)
+			*id = sent++;
+		return bytes;
+#else
+		*id = completed - 1;
+		return ::send(fd, data, size, MSG_NOSIGNAL);
+#endif
+	}
+
+	bool is_complete(uint32_t id) const
+	{
+		return (int32_t)(completed - id) > 0;
+	}
+
+	bool idle() const
+	{
+		return sent == completed;
+	}
+
+	/* Collect notifications after POLLERR. Throws on a real socket error. */
+	void reap()
+	{
+#ifdef ENDPOINT_HAVE_ZEROCOPY
+		bool any = false;
+		for (;;)
+		{
+			char control[128];
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					throw datra::IOException("zerocopy completion");
+				break;
+			}
+			for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				const struct sock_extended_err* ee = (const struct sock_extended_err*)CMSG_DATA(cm);
+				if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+					continue;
+				/* Range ee_info..ee_data, they complete in order */
+				completed = ee->ee_data + 1;
+				if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					copied = true;
+				any = true;
+			}
+		}
+		if (!any)
+		{
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0)
+				throw datra::IOException(err);
+		}
+#endif
+	}
+};
@@ -0,0 +1,170 @@
+/*
+ * framing.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+/*
+ * Byte ring for datraproxy's input. Positions are stream offsets that
+ * only grow; iov() turns a range into at most two iovecs, so one readv
+ * fills all free space and one writev sends everything up to a record
+ * boundary, also when that wraps around. The storage is page aligned.
+ */
+class ByteRing
+{
+	ByteRing(const ByteRing&);
+	ByteRing& operator=(const ByteRing&);
+	char* storage;
+public:
+	const size_t capacity;
+	uint64_t head; /* stream offset of the next byte to come in */
+
+	ByteRing(size_t size):
+		storage(NULL),
+		capacity(size),
+		head(0)
+	{
+		void* memory;
+		if (posix_memalign(&memory, 4096, size) != 0)
+			throw std::bad_alloc();
+		storage = (char*)memory;
+	}
+
+	~ByteRing()
+	{
+		free(storage);
+	}
+
+	/* iovecs for stream range [from, to), returns how many (0..2) */
+	int iov(uint64_t from, uint64_t to, struct iovec* v) const
+	{
+		if (to <= from)
+			return 0;
+		size_t start = from % capacity;
+		size_t length = to - from;
+		if (start + length <= capacity)
+		{
+			v[0].iov_base = storage + start;
+			v[0].iov_len = length;
+			return 1;
+		}
+		v[0].iov_base = storage + start;
+		v[0].iov_len = capacity - start;
+		v[1].iov_base = storage;
+		v[1].iov_len = length - (capacity - start);
+		return 2;
+	}
+};
+
+enum FramingMode
+{
+	FRAMING_NONE,   /* plain byte stream */
+	FRAMING_FIXED,  /* records of record_size bytes */
+	FRAMING_LENGTH  /* 32-bit big-endian length, then that many bytes */
+};
+
+#define FRAMING_HEADER_SIZE 4
+
+/*
+ * Finds record boundaries in a stream that arrives in pieces. Feed it
+ * each new piece in order, 'boundary' is then the stream offset just
+ * past the last complete record. Without framing that is everything.
+ */
+class RecordFramer
+{
+	FramingMode mode;
+	size_t record_size;
+	size_t max_record;  /* length mode: largest record that fits */
+	uint64_t record_end; /* length mode: end of the record being read */
+	uint32_t length;
+	unsigned int header_bytes;
+public:
+	uint64_t boundary;
+
+	RecordFramer(FramingMode framing, size_t size, size_t max_size):
+		mode(framing),
+		record_size(size),
+		max_record(max_size),
+		record_end(0),
+		length(0),
+		header_bytes(0),
+		boundary(0)
+	{
+	}
+
+	/* Piece at stream offset 'pos', returns the records it completed */
+	unsigned int scan(const char* data, uint64_t pos, size_t size)
+	{
+		switch (mode)
+		{
+		case FRAMING_NONE:
+			boundary = pos + size;
+			return 0;
+		case FRAMING_FIXED:
+			{
+				uint64_t end = (pos + size) - (pos + size) % record_size;
+				unsigned int records = (end - boundary) / record_size;
+				boundary = end;
+				return records;
+			}
+		case FRAMING_LENGTH:
+			break;
+		}
+		unsigned int records = 0;
+		const uint64_t end = pos + size;
+		while (pos < end)
+		{
+			if (header_bytes < FRAMING_HEADER_SIZE)
+			{
+				length = (length << 8) | (unsigned char)data[0];
+				++data;
+				++pos;
+				if (++header_bytes < FRAMING_HEADER_SIZE)
+					continue;
+				if ((uint64_t)length + FRAMING_HEADER_SIZE > max_record)
+					throw std::runtime_error("Record larger than the buffer, increase the blocksize");
+				record_end = pos + length;
+			}
+			uint64_t take = (record_end < end ? record_end : end) - pos;
+			data += take;
+			pos += take;
+			if (pos == record_end)
+			{
+				boundary = record_end;
+				++records;
+				header_bytes = 0;
+				length = 0;
+			}
+		}
+		return records;
+	}
+};
@@ -0,0 +1,100 @@
+/*
+ * hexdump.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Formats memory in the same layout as "xxd" (and "xxd -r" accepts):
+ * 00000010: 0100 0000 0200 0000 0300 0000 0400 0000  ................
+ * Table driven, no printf, so it keeps up with bulk reads.
+ */
+#define HEXDUMP_LINE_SIZE 68 /* Characters in a full line of 16 bytes */
+
+class HexFormatter
+{
+	char hex[256][2];
+	char ascii[256];
+public:
+	HexFormatter()
+	{
+		static const char digits[] = "0123456789abcdef";
+		for (unsigned int i = 0; i < 256; ++i)
+		{
+			hex[i][0] = digits[i >> 4];
+			hex[i][1] = digits[i & 15];
+			ascii[i] = (i >= 0x20 && i < 0x7f) ? (char)i : '.';
+		}
+	}
+
+	/* Format 'bytes' of data shown at 'offset' into out, which must hold
+	 * HEXDUMP_LINE_SIZE for every started line of 16. Returns the length. */
+	size_t format(char* out, const uint8_t* data, size_t bytes, uint32_t offset) const
+	{
+		char* o = out;
+		while (bytes)
+		{
+			size_t n = bytes < 16 ? bytes : 16;
+			for (int shift = 28; shift >= 0; shift -= 8)
+			{
+				const char* h = hex[(offset >> (shift - 4)) & 0xff];
+				*o++ = h[0];
+				*o++ = h[1];
+			}
+			*o++ = ':';
+			*o++ = ' ';
+			char* text = o + 41;
+			for (unsigned int i = 0; i < 16; ++i)
+			{
+				if (i < n)
+				{
+					*o++ = hex[data[i]][0];
+					*o++ = hex[data[i]][1];
+				}
+				else
+				{
+					*o++ = ' ';
+					*o++ = ' ';
+				}
+				if (i & 1)
+					*o++ = ' ';
+			}
+			*o++ = ' ';
+			for (unsigned int i = 0; i < n; ++i)
+				text[i] = ascii[data[i]];
+			o = text + n;
+			*o++ = '\n';
+			data += n;
+			offset += n;
+			bytes -= n;
+		}
+		return o - out;
+	}
+};
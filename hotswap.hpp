@@ -0,0 +1,243 @@
+/*
+ * hotswap.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <datra/hardware.hpp>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "metrics.hpp"
+#include "tracepoints.hpp"
+
+/* Route table buffer to start with, and how far it may grow */
+#define HOTSWAP_ROUTES 256
+#define HOTSWAP_MAX_ROUTES 65536
+
+/*
+ * Replacing the function on a node in a live pipeline without stopping
+ * the stream for the reconfiguration: the new function is programmed
+ * into a free partition while the old one keeps running, then the
+ * routes move over in one routeDelete/routeAdd pair and the old node
+ * is disabled. The stream only pauses for that route update.
+ * The functions take the context and control as template arguments, so
+ * a stand-in for the hardware can be passed (see hotswaptest.cpp).
+ */
+struct HotSwapResult
+{
+	int node;               /* where the function runs now */
+	int config;             /* config handle that keeps node claimed */
+	unsigned int routes;    /* routes that moved */
+	unsigned int bytes;     /* bitstream size */
+	uint64_t program_us;    /* programming, while the old node ran */
+	uint64_t reroute_us;    /* the interruption */
+};
+
+/* The whole route table. routeGetAll fills at most the buffer it gets,
+ * so a full buffer may mean there are more: grow it and ask again. */
+template <class Control>
+static inline std::vector<datra::HardwareControl::Route> hotswap_read_routes(Control& control)
+{
+	std::vector<datra::HardwareControl::Route> routes(HOTSWAP_ROUTES);
+	for (;;)
+	{
+		int n_routes = control.routeGetAll(&routes[0], routes.size());
+		if (n_routes < 0)
+			throw datra::IOException();
+		if ((unsigned int)n_routes < routes.size())
+		{
+			routes.resize(n_routes);
+			return routes;
+		}
+		if (routes.size() >= HOTSWAP_MAX_ROUTES)
+			throw std::runtime_error("Route table does not fit, not swapping");
+		routes.resize(routes.size() * 2);
+	}
+}
+
+static inline void hotswap_print_route(std::ostream& out, const datra::HardwareControl::Route& route)
+{
+	out << (int)route.srcNode << "." << (int)route.srcFifo
+		<< "->"
+		<< (int)route.dstNode << "." << (int)route.dstFifo;
+}
+
+/* The routes connected to old_node, pointing at new_node instead.
+ * Fifo numbers stay, so the new function must have the same layout. */
+static inline std::vector<datra::HardwareControl::Route> hotswap_routes(
+	const std::vector<datra::HardwareControl::Route>& routes, int old_node, int new_node)
+{
+	std::vector<datra::HardwareControl::Route> result;
+	for (std::vector<datra::HardwareControl::Route>::const_iterator route = routes.begin();
+			route != routes.end(); ++route)
+	{
+		if (route->srcNode != old_node && route->dstNode != old_node)
+			continue;
+		datra::HardwareControl::Route moved = *route;
+		if (moved.srcNode == old_node)
+			moved.srcNode = new_node;
+		if (moved.dstNode == old_node)
+			moved.dstNode = new_node;
+		result.push_back(moved);
+	}
+	return result;
+}
+
+/* Claims a partition other than old_node that can run the function,
+ * returns its config handle. The node stays ours while that is open. */
+template <class Context>
+static inline int hotswap_claim(Context& context, const char* function,
+	int old_node, int* node)
+{
+	unsigned int candidates = context.getAvailablePartitions(function);
+	if (candidates == 0)
+		throw std::runtime_error(std::string("Function does not exist: ") + function);
+	if (old_node > 0 && old_node < 32)
+		candidates &= ~(1u << old_node);
+	for (int id = 1; id < 32; ++id)
+	{
+		if ((candidates & (1u << id)) == 0)
+			continue;
+		int handle = context.openConfig(id, O_RDWR);
+		if (handle == -1)
+		{
+			if (errno != EBUSY)
+				throw datra::IOException(function);
+			continue;
+		}
+		*node = id;
+		return handle;
+	}
+	throw std::runtime_error(std::string("No free partition for ") + function);
+}
+
+/* Does the work for hotswap_function, once result.node is claimed */
+template <class Context, class Control>
+static inline void hotswap_to(Context& context, Control& control, const char* function,
+	int old_node, bool verbose, bool dry_run, HotSwapResult& result)
+{
+	std::string filename = context.findPartition(function, result.node);
+	if (filename.empty())
+		throw std::runtime_error(std::string("Function ") + function + " not available for its node");
+	if (dry_run)
+	{
+		std::vector<datra::HardwareControl::Route> moved =
+			hotswap_routes(hotswap_read_routes(control), old_node, result.node);
+		std::cerr << "Would program '" << function << "' into " << result.node
+			<< " using " << filename << ", then move " << moved.size() << " routes:" << std::endl;
+		for (unsigned int i = 0; i < moved.size(); ++i)
+		{
+			/* The new node is free, so it has no routes of its own */
+			datra::HardwareControl::Route was = moved[i];
+			if (was.srcNode == result.node)
+				was.srcNode = old_node;
+			if (was.dstNode == result.node)
+				was.dstNode = old_node;
+			std::cerr << "  ";
+			hotswap_print_route(std::cerr, was);
+			std::cerr << " becomes ";
+			hotswap_print_route(std::cerr, moved[i]);
+			std::cerr << std::endl;
+		}
+		result.routes = moved.size();
+		result.bytes = 0;
+		result.program_us = 0;
+		result.reroute_us = 0;
+		return;
+	}
+	if (verbose)
+		std::cerr << "Programming '" << function << "' into " << result.node
+			<< " using " << filename << std::endl;
+	Stopwatch watch;
+	watch.start();
+	datra::File input_file(filename.c_str(), O_RDONLY);
+	DATRA_PROBE2(datraprogrammer, program_start, result.node, function);
+	control.disableNode(result.node);
+	result.bytes = control.program(input_file);
+	control.enableNode(result.node);
+	DATRA_PROBE2(datraprogrammer, program_end, result.node, result.bytes);
+	watch.stop();
+	result.program_us = watch.elapsed_us();
+	/* Read the routes before the switch, so a failure there leaves the
+	 * old node running untouched */
+	std::vector<datra::HardwareControl::Route> routes = hotswap_read_routes(control);
+	/* Mapping old_node onto itself picks out its routes as they are */
+	std::vector<datra::HardwareControl::Route> original = hotswap_routes(routes, old_node, old_node);
+	std::vector<datra::HardwareControl::Route> moved = hotswap_routes(routes, old_node, result.node);
+	result.routes = moved.size();
+	watch.start();
+	DATRA_PROBE3(datraprogrammer, reroute_start, old_node, result.node, result.routes);
+	control.routeDelete(old_node);
+	try
+	{
+		if (!moved.empty())
+			control.routeAdd(&moved[0], moved.size());
+	}
+	catch (...)
+	{
+		/* Put the stream back on the old node, which is still running */
+		control.routeDelete(result.node);
+		if (!original.empty())
+			control.routeAdd(&original[0], original.size());
+		throw;
+	}
+	DATRA_PROBE2(datraprogrammer, reroute_end, result.node, result.routes);
+	watch.stop();
+	result.reroute_us = watch.elapsed_us();
+	control.disableNode(old_node);
+}
+
+/* With dry_run, only shows which node would be used and how the routes
+ * would change, leaving the hardware alone. Otherwise the caller owns
+ * result.config, closing it hands the new node back to the allocator. */
+template <class Context, class Control>
+static inline HotSwapResult hotswap_function(Context& context, Control& control,
+	const char* function, int old_node, bool verbose, bool dry_run = false)
+{
+	HotSwapResult result;
+	result.config = hotswap_claim(context, function, old_node, &result.node);
+	try
+	{
+		hotswap_to(context, control, function, old_node, verbose, dry_run, result);
+	}
+	catch (...)
+	{
+		::close(result.config);
+		throw;
+	}
+	if (dry_run)
+	{
+		::close(result.config);
+		result.config = -1;
+	}
+	return result;
+}
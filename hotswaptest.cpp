@@ -0,0 +1,278 @@
+/*
+ * hotswaptest.cpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+
+/*
+ * Runs the hot swap against a stand-in for the hardware: a context that
+ * hands out /dev/null as config handle and bitstream, and a control
+ * that keeps its route table in memory and can be told to fail.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include "hotswap.hpp"
+
+typedef datra::HardwareControl::Route Route;
+
+static int failures;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { std::cerr << __FILE__ << ":" << __LINE__ << ": FAIL: " #condition << std::endl; ++failures; } } while (0)
+
+static Route make_route(int srcNode, int srcFifo, int dstNode, int dstFifo)
+{
+	Route route;
+	route.srcNode = srcNode;
+	route.srcFifo = srcFifo;
+	route.dstNode = dstNode;
+	route.dstFifo = dstFifo;
+	return route;
+}
+
+class FakeContext
+{
+public:
+	unsigned int partitions; /* where the function fits */
+	unsigned int busy;       /* claimed by someone else */
+
+	FakeContext(): partitions(0), busy(0) {}
+
+	unsigned int getAvailablePartitions(const char*)
+	{
+		return partitions;
+	}
+
+	int openConfig(int node, int access)
+	{
+		if (busy & (1u << node))
+		{
+			errno = EBUSY;
+			return -1;
+		}
+		return ::open("/dev/null", access);
+	}
+
+	std::string findPartition(const char*, int)
+	{
+		return "/dev/null";
+	}
+};
+
+class FakeControl
+{
+public:
+	std::vector<Route> table;
+	unsigned int enabled;    /* node bitmask */
+	int disabled;            /* last node disabled, or -1 */
+	int programmed;          /* last node programmed, or -1 */
+	int fail_route_adds;     /* this many routeAdd calls throw */
+
+	FakeControl(): enabled(0), disabled(-1), programmed(-1), fail_route_adds(0) {}
+
+	int routeGetAll(Route* routes, int n)
+	{
+		int count = 0;
+		for (; count < n && count < (int)table.size(); ++count)
+			routes[count] = table[count];
+		return count;
+	}
+
+	void routeDelete(int node)
+	{
+		std::vector<Route> kept;
+		for (unsigned int i = 0; i < table.size(); ++i)
+			if (table[i].srcNode != node && table[i].dstNode != node)
+				kept.push_back(table[i]);
+		table.swap(kept);
+	}
+
+	void routeAdd(const Route* routes, int n)
+	{
+		if (fail_route_adds > 0)
+		{
+			--fail_route_adds;
+			throw std::runtime_error("routeAdd failed");
+		}
+		table.insert(table.end(), routes, routes + n);
+	}
+
+	void disableNode(int node)
+	{
+		enabled &= ~(1u << node);
+		disabled = node;
+	}
+
+	void enableNode(int node)
+	{
+		enabled |= (1u << node);
+	}
+
+	unsigned int program(int)
+	{
+		programmed = disabled;
+		return 1234;
+	}
+};
+
+/* Number of routes connected to node */
+static unsigned int count_routes(const std::vector<Route>& table, int node)
+{
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < table.size(); ++i)
+		if (table[i].srcNode == node || table[i].dstNode == node)
+			++n;
+	return n;
+}
+
+/* A pipeline 0 -> 2 -> 0, and an unrelated 1 -> 5 */
+static void setup(FakeContext& context, FakeControl& control)
+{
+	context.partitions = (1u << 2) | (1u << 3) | (1u << 4);
+	context.busy = (1u << 3);
+	control.table.clear();
+	control.table.push_back(make_route(0, 0, 2, 0));
+	control.table.push_back(make_route(2, 0, 0, 1));
+	control.table.push_back(make_route(1, 0, 5, 0));
+	control.enabled = (1u << 2) | (1u << 4);
+}
+
+static void test_routes()
+{
+	std::vector<Route> routes;
+	routes.push_back(make_route(0, 0, 2, 1));
+	routes.push_back(make_route(2, 3, 2, 0));
+	routes.push_back(make_route(1, 0, 5, 0));
+	std::vector<Route> moved = hotswap_routes(routes, 2, 4);
+	CHECK(moved.size() == 2);
+	CHECK(moved[0].srcNode == 0 && moved[0].dstNode == 4 && moved[0].dstFifo == 1);
+	CHECK(moved[1].srcNode == 4 && moved[1].srcFifo == 3 && moved[1].dstNode == 4);
+}
+
+static void test_read_routes()
+{
+	FakeControl control;
+	for (int i = 0; i < HOTSWAP_ROUTES + 44; ++i)
+		control.table.push_back(make_route(1, i % 4, 2, i % 4));
+	CHECK(hotswap_read_routes(control).size() == control.table.size());
+}
+
+static void test_swap()
+{
+	FakeContext context;
+	FakeControl control;
+	setup(context, control);
+	HotSwapResult result = hotswap_function(context, control, "fn", 2, false);
+	CHECK(result.node == 4); /* 3 is busy */
+	CHECK(result.config != -1);
+	CHECK(result.routes == 2);
+	CHECK(result.bytes == 1234);
+	CHECK(control.programmed == 4);
+	CHECK(count_routes(control.table, 2) == 0);
+	CHECK(count_routes(control.table, 4) == 2);
+	CHECK(count_routes(control.table, 5) == 1);
+	CHECK((control.enabled & (1u << 2)) == 0);
+	CHECK((control.enabled & (1u << 4)) != 0);
+	::close(result.config);
+}
+
+static void test_dry_run()
+{
+	FakeContext context;
+	FakeControl control;
+	setup(context, control);
+	std::vector<Route> before = control.table;
+	HotSwapResult result = hotswap_function(context, control, "fn", 2, false, true);
+	CHECK(result.node == 4);
+	CHECK(result.config == -1);
+	CHECK(result.routes == 2);
+	CHECK(control.programmed == -1);
+	CHECK(control.table.size() == before.size());
+	CHECK(count_routes(control.table, 2) == 2);
+}
+
+static void test_failed_reroute()
+{
+	FakeContext context;
+	FakeControl control;
+	setup(context, control);
+	control.fail_route_adds = 1;
+	bool thrown = false;
+	try
+	{
+		hotswap_function(context, control, "fn", 2, false);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+	/* The stream is back on the old node, which still runs */
+	CHECK(count_routes(control.table, 2) == 2);
+	CHECK(count_routes(control.table, 4) == 0);
+	CHECK(control.table.size() == 3);
+	CHECK((control.enabled & (1u << 2)) != 0);
+}
+
+static void test_no_partition()
+{
+	FakeContext context;
+	FakeControl control;
+	setup(context, control);
+	context.busy |= (1u << 4);
+	bool thrown = false;
+	try
+	{
+		hotswap_function(context, control, "fn", 2, false);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+	CHECK(control.programmed == -1);
+	CHECK(count_routes(control.table, 2) == 2);
+}
+
+int main()
+{
+	test_routes();
+	test_read_routes();
+	test_swap();
+	test_dry_run();
+	test_failed_reroute();
+	test_no_partition();
+	if (failures)
+	{
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -1,5 +1,5 @@
 /*
- * benchmark.hpp
+ * licensekey.hpp
  *
  * Datra commandline utilities.
  *
@@ -25,33 +25,17 @@
  * You can contact Topic by electronic mail via info@topic.nl or via
  * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
  */
-#include <time.h>
+#pragma once
 
-class Stopwatch
-{
-public:
-	struct timespec m_start;
-	struct timespec m_stop;
-	
-	Stopwatch()
-	{
-		clock_gettime(CLOCK_MONOTONIC, &m_start);
-	}
-	
-	void start()
-	{
-		clock_gettime(CLOCK_MONOTONIC, &m_start);
-	}
-	
-	void stop()
-	{
-		clock_gettime(CLOCK_MONOTONIC, &m_stop);
-	}
+#include <stdlib.h>
+#include <errno.h>
 
-	unsigned int elapsed_us()
-	{
-		return 
-			((m_stop.tv_sec - m_start.tv_sec) * 1000000) +
-				(m_stop.tv_nsec - m_start.tv_nsec) / 1000;
-	}
-};
+/* Keys use all 64 bits, strtoll would clip those with the top bit set.
+ * Returns false unless the whole text is a number that fits. */
+static inline bool parse_key(const char* text, unsigned long long* key)
+{
+	char* end;
+	errno = 0;
+	*key = strtoull(text, &end, 0);
+	return end != text && *end == '\0' && errno == 0 && text[0] != '-';
+}
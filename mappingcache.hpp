@@ -0,0 +1,147 @@
+/*
+ * mappingcache.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <datra/hardware.hpp>
+#include <datra/mmapio.hpp>
+#include <map>
+#include <vector>
+
+/*
+ * Keeps device files and memory maps open across many accesses. A
+ * request that touches pages already mapped reuses that mapping. When
+ * it overlaps existing mappings, those are replaced by one mapping
+ * covering all of them. The mappings replaced that way stay until
+ * release() or until the cache goes, so pointers handed out earlier
+ * remain valid until then.
+ */
+class MappingCache
+{
+	struct Mapping
+	{
+		off_t start; /* page aligned */
+		size_t size; /* multiple of page_size */
+		datra::MemoryMap* map;
+	};
+	typedef std::vector<Mapping> MappingList;
+
+	datra::HardwareContext& context;
+	int access;
+	size_t page_size;
+	std::map<int, datra::File*> files;
+	std::map<int, MappingList> mappings;
+	std::vector<datra::MemoryMap*> superseded;
+
+	datra::File& file(int node)
+	{
+		std::map<int, datra::File*>::iterator it = files.find(node);
+		if (it != files.end())
+			return *it->second;
+		datra::File* f = new datra::File(node < 0 ?
+			context.openControl(access) : context.openConfig(node, access));
+		files[node] = f;
+		return *f;
+	}
+public:
+	unsigned int hits;
+	unsigned int misses;
+
+	MappingCache(datra::HardwareContext& ctx, int access_mode, size_t page = 4096):
+		context(ctx),
+		access(access_mode),
+		page_size(page),
+		hits(0),
+		misses(0)
+	{
+	}
+
+	~MappingCache()
+	{
+		for (std::map<int, MappingList>::iterator it = mappings.begin(); it != mappings.end(); ++it)
+			for (unsigned int i = 0; i < it->second.size(); ++i)
+				delete it->second[i].map;
+		for (unsigned int i = 0; i < superseded.size(); ++i)
+			delete superseded[i];
+		for (std::map<int, datra::File*>::iterator it = files.begin(); it != files.end(); ++it)
+			delete it->second;
+	}
+
+	/* Unmaps what merges replaced. Only call this when no pointer that
+	 * get() returned earlier is in use any more. */
+	void release()
+	{
+		for (unsigned int i = 0; i < superseded.size(); ++i)
+			delete superseded[i];
+		superseded.clear();
+	}
+
+	/* Returns a pointer to 'size' bytes at 'addr' of the node's memory */
+	volatile void* get(int node, off_t addr, size_t size)
+	{
+		off_t start = addr & ~(off_t)(page_size - 1);
+		off_t end = (addr + size + page_size - 1) & ~(off_t)(page_size - 1);
+		MappingList& list = mappings[node];
+		for (unsigned int i = 0; i < list.size(); ++i)
+		{
+			if (list[i].start <= start && (off_t)(list[i].start + list[i].size) >= end)
+			{
+				++hits;
+				return ((char*)list[i].map->memory) + (addr - list[i].start);
+			}
+		}
+		++misses;
+		/* Grow the range to swallow any mapping it overlaps */
+		bool merged;
+		do
+		{
+			merged = false;
+			for (unsigned int i = 0; i < list.size(); ++i)
+			{
+				off_t other_end = list[i].start + list[i].size;
+				if (list[i].start < end && other_end > start)
+				{
+					if (list[i].start < start)
+						start = list[i].start;
+					if (other_end > end)
+						end = other_end;
+					superseded.push_back(list[i].map);
+					list.erase(list.begin() + i);
+					merged = true;
+					break;
+				}
+			}
+		} while (merged);
+		Mapping m;
+		m.start = start;
+		m.size = end - start;
+		m.map = new datra::MemoryMap(file(node), start, m.size,
+			access == O_RDONLY ? PROT_READ : PROT_READ|PROT_WRITE);
+		list.push_back(m);
+		return ((char*)m.map->memory) + (addr - start);
+	}
+};
@@ -0,0 +1,474 @@
+/*
+ * metrics.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Instrumentation shared by the datra tools: timers, histograms, rate
+ * meters and one reporter, so all tools print numbers the same way.
+ */
+
+static inline uint64_t monotonic_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000u) + now.tv_nsec;
+}
+
+class Stopwatch
+{
+public:
+	uint64_t m_start;
+	uint64_t m_stop;
+
+	Stopwatch():
+		m_start(monotonic_ns()),
+		m_stop(m_start)
+	{
+	}
+
+	void start()
+	{
+		m_start = monotonic_ns();
+	}
+
+	void stop()
+	{
+		m_stop = monotonic_ns();
+	}
+
+	uint64_t elapsed_ns() const
+	{
+		return m_stop - m_start;
+	}
+
+	uint64_t elapsed_us() const
+	{
+		return (m_stop - m_start) / 1000;
+	}
+};
+
+/*
+ * Cycle counter for timing single bus accesses. Uses the TSC on x86 and
+ * the virtual counter on aarch64. Elsewhere (32-bit ARM normally has the
+ * PMU locked for userspace) it falls back to CLOCK_MONOTONIC in ns.
+ */
+static inline uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+	return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t result;
+	__asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r" (result) : : "memory");
+	return result;
+#else
+	return monotonic_ns();
+#endif
+}
+
+class CycleTimer
+{
+public:
+	double ns_per_cycle;
+	uint64_t overhead; /* Cost of back-to-back read_cycles() calls */
+
+	/* Measures the counter frequency against CLOCK_MONOTONIC for about
+	 * 10ms, and the minimum cost of reading the counter. */
+	CycleTimer()
+	{
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		uint64_t c0 = read_cycles();
+		do
+		{
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+		} while (((t1.tv_sec - t0.tv_sec) * 1000000000ll) + (t1.tv_nsec - t0.tv_nsec) < 10000000);
+		uint64_t c1 = read_cycles();
+		ns_per_cycle =
+			(double)(((t1.tv_sec - t0.tv_sec) * 1000000000ll) + (t1.tv_nsec - t0.tv_nsec)) /
+			(double)(c1 - c0);
+		overhead = ~(uint64_t)0;
+		for (int i = 0; i < 1000; ++i)
+		{
+			uint64_t a = read_cycles();
+			uint64_t b = read_cycles();
+			if (b - a < overhead)
+				overhead = b - a;
+		}
+	}
+
+	/* Converts a measured interval to ns, minus the timer's own cost */
+	uint64_t to_ns(uint64_t cycles) const
+	{
+		cycles = (cycles > overhead) ? cycles - overhead : 0;
+		return (uint64_t)(cycles * ns_per_cycle + 0.5);
+	}
+};
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: each power of two
+ * is split into 2^HISTOGRAM_SUB_BITS linear buckets, so values are kept
+ * with about 3% precision over the full 64-bit range.
+ */
+#define HISTOGRAM_SUB_BITS 5
+
+class Histogram
+{
+public:
+	std::vector<uint64_t> buckets;
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+
+	Histogram():
+		buckets((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS),
+		total(0),
+		sum(0),
+		min(~(uint64_t)0),
+		max(0)
+	{
+	}
+
+	static unsigned int index(uint64_t value)
+	{
+		if (value < (1u << HISTOGRAM_SUB_BITS))
+			return value;
+		unsigned int magnitude = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+		return ((magnitude + 1) << HISTOGRAM_SUB_BITS) +
+			(unsigned int)(value >> magnitude) - (1u << HISTOGRAM_SUB_BITS);
+	}
+
+	/* Highest value that ends up in the bucket */
+	static uint64_t highest(unsigned int index)
+	{
+		if (index < (2u << HISTOGRAM_SUB_BITS))
+			return index;
+		unsigned int magnitude = (index >> HISTOGRAM_SUB_BITS) - 1;
+		uint64_t sub = (index & ((1u << HISTOGRAM_SUB_BITS) - 1)) + (1u << HISTOGRAM_SUB_BITS);
+		return ((sub + 1) << magnitude) - 1;
+	}
+
+	void record(uint64_t value)
+	{
+		++buckets[index(value)];
+		++total;
+		sum += value;
+		if (value < min)
+			min = value;
+		if (value > max)
+			max = value;
+	}
+
+	void merge(const Histogram& other)
+	{
+		for (unsigned int i = 0; i < buckets.size(); ++i)
+			buckets[i] += other.buckets[i];
+		total += other.total;
+		sum += other.sum;
+		if (other.min < min)
+			min = other.min;
+		if (other.max > max)
+			max = other.max;
+	}
+
+	double mean() const
+	{
+		return total ? (double)sum / total : 0.0;
+	}
+
+	uint64_t percentile(double p) const
+	{
+		uint64_t wanted = (uint64_t)((p / 100.0) * total + 0.5);
+		if (wanted == 0)
+			wanted = 1;
+		uint64_t seen = 0;
+		for (unsigned int i = 0; i < buckets.size(); ++i)
+		{
+			seen += buckets[i];
+			if (seen >= wanted)
+				return highest(i) < max ? highest(i) : max;
+		}
+		return max;
+	}
+};
+
+/* Counts events (or bytes) and tells the rate overall and since the
+ * previous call to interval_rate(). */
+class RateMeter
+{
+	uint64_t m_start;
+	uint64_t m_interval_start;
+	uint64_t m_interval_count;
+public:
+	uint64_t count;
+
+	RateMeter():
+		m_start(monotonic_ns()),
+		m_interval_start(m_start),
+		m_interval_count(0),
+		count(0)
+	{
+	}
+
+	void add(uint64_t n)
+	{
+		count += n;
+	}
+
+	/* Per second since construction */
+	double rate() const
+	{
+		uint64_t elapsed = monotonic_ns() - m_start;
+		return elapsed ? count * 1e9 / elapsed : 0.0;
+	}
+
+	/* Per second since the previous call */
+	double interval_rate()
+	{
+		uint64_t now = monotonic_ns();
+		uint64_t elapsed = now - m_interval_start;
+		double result = elapsed ? (count - m_interval_count) * 1e9 / elapsed : 0.0;
+		m_interval_start = now;
+		m_interval_count = count;
+		return result;
+	}
+};
+
+enum MetricsFormat
+{
+	METRICS_TEXT,
+	METRICS_JSON,
+	METRICS_CSV
+};
+
+/* Returns false if the name is not one of text, json or csv */
+static inline bool parse_metrics_format(const char* name, MetricsFormat* format)
+{
+	if (strcmp(name, "text") == 0)
+		*format = METRICS_TEXT;
+	else if (strcmp(name, "json") == 0)
+		*format = METRICS_JSON;
+	else if (strcmp(name, "csv") == 0)
+		*format = METRICS_CSV;
+	else
+		return false;
+	return true;
+}
+
+/* One line of results, as key/value pairs in the order they were added */
+class MetricsRow
+{
+public:
+	struct Field
+	{
+		std::string key;
+		std::string value;
+		bool text; /* Quote in JSON */
+	};
+	std::vector<Field> fields;
+
+	MetricsRow& add(const char* key, const char* value)
+	{
+		Field f;
+		f.key = key;
+		f.value = value;
+		f.text = true;
+		fields.push_back(f);
+		return *this;
+	}
+
+	MetricsRow& add(const char* key, unsigned long long value)
+	{
+		char buffer[24];
+		snprintf(buffer, sizeof(buffer), "%llu", value);
+		return add_number(key, buffer);
+	}
+
+	MetricsRow& add(const char* key, long long value)
+	{
+		char buffer[24];
+		snprintf(buffer, sizeof(buffer), "%lld", value);
+		return add_number(key, buffer);
+	}
+
+	MetricsRow& add(const char* key, unsigned long value) { return add(key, (unsigned long long)value); }
+	MetricsRow& add(const char* key, unsigned int value) { return add(key, (unsigned long long)value); }
+	MetricsRow& add(const char* key, long value) { return add(key, (long long)value); }
+	MetricsRow& add(const char* key, int value) { return add(key, (long long)value); }
+
+	MetricsRow& add(const char* key, double value)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.1f", value);
+		return add_number(key, buffer);
+	}
+
+	/* Adds key_count, key_min, key_mean, key_p50 ... key_max */
+	MetricsRow& add(const char* key, const Histogram& histogram)
+	{
+		static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+		static const char* const names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+		std::string prefix(key);
+		add((prefix + "_count").c_str(), (unsigned long long)histogram.total);
+		add((prefix + "_min").c_str(), (unsigned long long)(histogram.total ? histogram.min : 0));
+		add((prefix + "_mean").c_str(), histogram.mean());
+		for (unsigned int i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); ++i)
+			add((prefix + "_" + names[i]).c_str(),
+				(unsigned long long)histogram.percentile(percentiles[i]));
+		add((prefix + "_max").c_str(), (unsigned long long)histogram.max);
+		return *this;
+	}
+private:
+	MetricsRow& add_number(const char* key, const char* value)
+	{
+		Field f;
+		f.key = key;
+		f.value = value;
+		f.text = false;
+		fields.push_back(f);
+		return *this;
+	}
+};
+
+/*
+ * Writes rows as "key=value ..." lines, as a JSON array of objects or
+ * as CSV (with a new header line whenever the columns change). Rows go
+ * out as they come, finish() (or the destructor) ends the output.
+ */
+class MetricsReporter
+{
+	FILE* output;
+	unsigned int rows;
+	std::vector<std::string> columns;
+
+	static void json_string(FILE* out, const std::string& s)
+	{
+		fputc('"', out);
+		for (std::string::const_iterator c = s.begin(); c != s.end(); ++c)
+		{
+			unsigned char ch = *c;
+			if (ch == '"' || ch == '\\')
+			{
+				fputc('\\', out);
+				fputc(ch, out);
+			}
+			else if (ch == '\n')
+				fputs("\\n", out);
+			else if (ch == '\t')
+				fputs("\\t", out);
+			else if (ch < 0x20)
+				fprintf(out, "\\u%04x", ch);
+			else
+				fputc(ch, out);
+		}
+		fputc('"', out);
+	}
+public:
+	MetricsFormat format;
+
+	MetricsReporter(FILE* out = stdout, MetricsFormat f = METRICS_TEXT):
+		output(out),
+		rows(0),
+		format(f)
+	{
+	}
+
+	void emit(const MetricsRow& row)
+	{
+		const std::vector<MetricsRow::Field>& fields = row.fields;
+		switch (format)
+		{
+		case METRICS_TEXT:
+			for (unsigned int i = 0; i < fields.size(); ++i)
+				fprintf(output, "%s%s=%s", i ? " " : "", fields[i].key.c_str(), fields[i].value.c_str());
+			fputc('\n', output);
+			break;
+		case METRICS_JSON:
+			fputs(rows ? ",\n  {" : "[\n  {", output);
+			for (unsigned int i = 0; i < fields.size(); ++i)
+			{
+				if (i)
+					fputs(", ", output);
+				json_string(output, fields[i].key);
+				fputs(": ", output);
+				if (fields[i].text)
+					json_string(output, fields[i].value);
+				else
+					fputs(fields[i].value.c_str(), output);
+			}
+			fputc('}', output);
+			break;
+		case METRICS_CSV:
+			{
+				bool same = (columns.size() == fields.size());
+				for (unsigned int i = 0; same && i < fields.size(); ++i)
+					same = (columns[i] == fields[i].key);
+				if (!same)
+				{
+					columns.clear();
+					for (unsigned int i = 0; i < fields.size(); ++i)
+					{
+						columns.push_back(fields[i].key);
+						fprintf(output, "%s%s", i ? "," : "", fields[i].key.c_str());
+					}
+					fputc('\n', output);
+				}
+				for (unsigned int i = 0; i < fields.size(); ++i)
+					fprintf(output, "%s%s", i ? "," : "", fields[i].value.c_str());
+				fputc('\n', output);
+			}
+			break;
+		}
+		++rows;
+		fflush(output);
+	}
+
+	~MetricsReporter()
+	{
+		finish();
+	}
+
+	/* Closes the JSON array, if anything was written at all */
+	void finish()
+	{
+		if (format == METRICS_JSON && rows)
+			fputs("\n]\n", output);
+		rows = 0;
+		fflush(output);
+	}
+};
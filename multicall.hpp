@@ -0,0 +1,47 @@
+/*
+ * multicall.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+/*
+ * With --enable-multicall all tools are linked into one "datrautils"
+ * binary, and each tool's main() becomes <tool>_main(). Since all tools
+ * then share one link, classes local to a tool must have unique names.
+ */
+#ifdef DATRA_MULTICALL
+#	define DATRA_MAIN(name) name##_main
+#else
+#	define DATRA_MAIN(name) main
+#endif
+
+int datraaxiprobe_main(int argc, char** argv);
+int datraboot_main(int argc, char** argv);
+int datralicense_main(int argc, char** argv);
+int datraprogrammer_main(int argc, char** argv);
+int datraproxy_main(int argc, char** argv);
+int datraproxystat_main(int argc, char** argv);
+int datraroute_main(int argc, char** argv);
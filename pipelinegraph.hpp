@@ -0,0 +1,186 @@
+/*
+ * pipelinegraph.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Pipeline description for datraproxy:
+ *   pipeline := stage ['|' stage ...]
+ *   stage    := function | split(pipeline, pipeline [, ...])
+ * e.g. "split(lowPass,highPass|gain)|mix". A function feeding a split
+ * sends its output fifo N into the Nth branch. A stage after a split
+ * gets the Nth branch on its input fifo N. So fifo indices, not route
+ * duplication, carry the fan-out and fan-in, which is what the
+ * hardware can do: each fifo has one route.
+ */
+struct GraphStage
+{
+	std::string function;             /* empty for a split */
+	std::vector<unsigned int> branches; /* indices in PipelineGraph::pipelines */
+};
+
+typedef std::vector<GraphStage> GraphPipeline;
+
+class GraphSyntaxError: public std::runtime_error
+{
+public:
+	GraphSyntaxError(const std::string& text, std::string::size_type pos, const char* what):
+		std::runtime_error("Pipeline '" + text + "', position " +
+			number(pos + 1) + ": " + what)
+	{
+	}
+private:
+	static std::string number(std::string::size_type n)
+	{
+		std::string result;
+		do
+		{
+			result.insert(result.begin(), (char)('0' + n % 10));
+			n /= 10;
+		} while (n);
+		return result;
+	}
+};
+
+class PipelineGraph
+{
+	std::string text;
+	std::string::size_type pos;
+
+	static bool is_name_char(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+			(c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+	}
+
+	void skip_space()
+	{
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t'))
+			++pos;
+	}
+
+	bool accept(char c)
+	{
+		skip_space();
+		if (pos < text.size() && text[pos] == c)
+		{
+			++pos;
+			return true;
+		}
+		return false;
+	}
+
+	unsigned int parse_pipeline()
+	{
+		unsigned int index = pipelines.size();
+		pipelines.push_back(GraphPipeline());
+		do
+		{
+			GraphStage stage = parse_stage();
+			pipelines[index].push_back(stage);
+		} while (accept('|'));
+		return index;
+	}
+
+	GraphStage parse_stage()
+	{
+		skip_space();
+		std::string::size_type start = pos;
+		while (pos < text.size() && is_name_char(text[pos]))
+			++pos;
+		if (pos == start)
+			throw GraphSyntaxError(text, pos, "function name expected");
+		GraphStage stage;
+		std::string name = text.substr(start, pos - start);
+		if (name == "split" && accept('('))
+		{
+			do
+			{
+				unsigned int branch = parse_pipeline();
+				stage.branches.push_back(branch);
+			} while (accept(','));
+			if (!accept(')'))
+				throw GraphSyntaxError(text, pos, "',' or ')' expected");
+			if (stage.branches.size() < 2)
+				throw GraphSyntaxError(text, pos, "split needs at least two branches");
+		}
+		else
+			stage.function = name;
+		return stage;
+	}
+public:
+	/* pipelines[0] is the whole graph, the others are split branches */
+	std::vector<GraphPipeline> pipelines;
+
+	PipelineGraph(const std::string& description):
+		text(description),
+		pos(0)
+	{
+		parse_pipeline();
+		skip_space();
+		if (pos != text.size())
+			throw GraphSyntaxError(text, pos, "unexpected character");
+	}
+
+	const std::string& description() const
+	{
+		return text;
+	}
+
+	/* Number of input fifos the stage needs */
+	unsigned int stage_inputs(const GraphStage& stage) const
+	{
+		if (stage.branches.empty())
+			return 1;
+		unsigned int result = 0;
+		for (unsigned int i = 0; i < stage.branches.size(); ++i)
+			result += inputs(stage.branches[i]);
+		return result;
+	}
+
+	/* Number of input fifos the pipeline needs */
+	unsigned int inputs(unsigned int pipeline) const
+	{
+		return stage_inputs(pipelines[pipeline][0]);
+	}
+
+	/* Number of fifos the pipeline's output comes out of */
+	unsigned int outputs(unsigned int pipeline) const
+	{
+		const GraphStage& last = pipelines[pipeline].back();
+		if (last.branches.empty())
+			return 1;
+		unsigned int result = 0;
+		for (unsigned int i = 0; i < last.branches.size(); ++i)
+			result += outputs(last.branches[i]);
+		return result;
+	}
+};
@@ -0,0 +1,227 @@
+/*
+ * proxystats.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <datra/fileio.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+/*
+ * Live datraproxy counters in a POSIX shared memory object (which shows
+ * up in /dev/shm). The proxy updates a private copy in its transfer loop
+ * and publishes it under a sequence lock, so neither side makes a system
+ * call per update. A reader copies the counters and retries when the
+ * sequence was odd (update in progress) or changed while copying.
+ */
+#define PROXYSTATS_MAGIC 0x53505244 /* "DRPS" */
+#define PROXYSTATS_VERSION 1
+#define PROXYSTATS_TEXT_SIZE 128
+
+/* Index into ProxyCounters::eagain, same order as the poll slots */
+enum ProxyStatsChannel
+{
+	PROXYSTATS_INPUT,
+	PROXYSTATS_TO_HARDWARE,
+	PROXYSTATS_FROM_HARDWARE,
+	PROXYSTATS_OUTPUT
+};
+
+#define PROXYSTATS_CHANNELS 4
+
+static const char* const proxystats_channel_names[PROXYSTATS_CHANNELS] = {
+	"input",
+	"to_hardware",
+	"from_hardware",
+	"output"
+};
+
+struct ProxyCounters
+{
+	uint64_t bytes_in;    /* read from the input */
+	uint64_t bytes_out;   /* written to the output */
+	uint64_t blocks_in;   /* reads from the input */
+	uint64_t blocks_out;  /* reads from the hardware */
+	uint64_t polls;       /* poll() wakeups */
+	uint64_t eagain[PROXYSTATS_CHANNELS];
+	uint32_t pending_in;  /* bytes buffered towards the hardware */
+	uint32_t pending_out; /* bytes buffered towards the output */
+	uint32_t blocksize;
+	uint32_t input_eof;
+};
+
+struct ProxyStatsSegment
+{
+	uint32_t magic;    /* set last, once the identity below is filled in */
+	uint32_t version;
+	uint32_t size;     /* sizeof(ProxyStatsSegment) */
+	uint32_t sequence; /* odd while the counters are being updated */
+	int32_t pid;
+	uint32_t reserved;
+	uint64_t start_time; /* seconds since the epoch */
+	char pipeline[PROXYSTATS_TEXT_SIZE]; /* function names */
+	char routes[PROXYSTATS_TEXT_SIZE];   /* route table */
+	ProxyCounters counters;
+};
+
+/* Writer side, owned by datraproxy. The counters are always kept, open()
+ * creates the shared object that publish() copies them into. It is
+ * removed again when destroyed. */
+class ProxyStats
+{
+	std::string name;
+	ProxyStatsSegment* segment;
+public:
+	ProxyCounters counters;
+
+	ProxyStats():
+		segment(NULL)
+	{
+		memset(&counters, 0, sizeof(counters));
+	}
+
+	~ProxyStats()
+	{
+		if (segment)
+		{
+			munmap(segment, sizeof(ProxyStatsSegment));
+			shm_unlink(name.c_str());
+		}
+	}
+
+	bool enabled() const
+	{
+		return segment != NULL;
+	}
+
+	void open(const char* shm_name, const std::string& pipeline, const std::string& routes)
+	{
+		name = (shm_name[0] == '/') ? shm_name : std::string("/") + shm_name;
+		int fd = shm_open(name.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if (fd == -1)
+			throw datra::IOException(name.c_str());
+		if (ftruncate(fd, sizeof(ProxyStatsSegment)) != 0)
+		{
+			::close(fd);
+			shm_unlink(name.c_str());
+			throw datra::IOException(name.c_str());
+		}
+		void* memory = mmap(NULL, sizeof(ProxyStatsSegment), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (memory == MAP_FAILED)
+		{
+			shm_unlink(name.c_str());
+			throw datra::IOException(name.c_str());
+		}
+		segment = (ProxyStatsSegment*)memory;
+		segment->version = PROXYSTATS_VERSION;
+		segment->size = sizeof(ProxyStatsSegment);
+		segment->pid = getpid();
+		segment->start_time = time(NULL);
+		strncpy(segment->pipeline, pipeline.c_str(), PROXYSTATS_TEXT_SIZE - 1);
+		strncpy(segment->routes, routes.c_str(), PROXYSTATS_TEXT_SIZE - 1);
+		__atomic_store_n(&segment->magic, PROXYSTATS_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	/* Copy the private counters into the shared segment */
+	void publish()
+	{
+		uint32_t sequence = segment->sequence;
+		__atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		segment->counters = counters;
+		__atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+	}
+};
+
+/* Reader side, maps an existing segment read-only */
+class ProxyStatsView
+{
+	ProxyStatsView(const ProxyStatsView&);
+	ProxyStatsView& operator=(const ProxyStatsView&);
+public:
+	const ProxyStatsSegment* segment;
+
+	/* Throws when the object does not exist or is not a proxy segment */
+	ProxyStatsView(const char* shm_name):
+		segment(NULL)
+	{
+		std::string name(shm_name[0] == '/' ? shm_name : std::string("/") + shm_name);
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd == -1)
+			throw datra::IOException(name.c_str());
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ProxyStatsSegment))
+		{
+			::close(fd);
+			throw datra::IOException(EINVAL);
+		}
+		void* memory = mmap(NULL, sizeof(ProxyStatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (memory == MAP_FAILED)
+			throw datra::IOException(name.c_str());
+		segment = (const ProxyStatsSegment*)memory;
+		if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != PROXYSTATS_MAGIC ||
+			segment->version != PROXYSTATS_VERSION)
+		{
+			munmap((void*)segment, sizeof(ProxyStatsSegment));
+			throw datra::IOException(EINVAL);
+		}
+	}
+
+	~ProxyStatsView()
+	{
+		munmap((void*)segment, sizeof(ProxyStatsSegment));
+	}
+
+	/* Consistent snapshot of the counters. Returns false when the writer
+	 * keeps the lock, e.g. because it died halfway through an update. */
+	bool read(ProxyCounters* result) const
+	{
+		for (unsigned int attempt = 0; attempt < 1000; ++attempt)
+		{
+			uint32_t before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+			if ((before & 1) == 0)
+			{
+				memcpy(result, (const void*)&segment->counters, sizeof(*result));
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) == before)
+					return true;
+			}
+			sched_yield();
+		}
+		return false;
+	}
+};
@@ -0,0 +1,74 @@
+/*
+ * registerwait.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2013,2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include "metrics.hpp"
+
+struct RegisterWaitResult
+{
+	bool success;
+	uint32_t value; /* Last value read */
+	unsigned int polls;
+	uint64_t elapsed_us;
+};
+
+/*
+ * Wait until (*reg & mask) == value. Spins on the register for spin_us,
+ * which catches fast hardware without a context switch. After that it
+ * sleeps between polls, doubling the sleep from 1us up to 1ms, so slow
+ * completions don't burn a CPU. Gives up after timeout_us.
+ */
+static inline RegisterWaitResult wait_register(volatile uint32_t* reg,
+	uint32_t mask, uint32_t value, uint64_t timeout_us, unsigned int spin_us)
+{
+	RegisterWaitResult result;
+	result.polls = 0;
+	Stopwatch timer;
+	timer.start();
+	long sleep_ns = 1000;
+	for (;;)
+	{
+		result.value = *reg;
+		++result.polls;
+		timer.stop();
+		result.elapsed_us = timer.elapsed_us();
+		result.success = ((result.value & mask) == value);
+		if (result.success || result.elapsed_us >= timeout_us)
+			break;
+		if (result.elapsed_us >= spin_us)
+		{
+			struct timespec pause = { 0, sleep_ns };
+			nanosleep(&pause, NULL);
+			if (sleep_ns < 1000000)
+				sleep_ns <<= 1;
+		}
+	}
+	return result;
+}
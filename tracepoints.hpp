@@ -0,0 +1,54 @@
+/*
+ * tracepoints.hpp
+ *
+ * Datra commandline utilities.
+ *
+ * (C) Copyright 2014 Topic Embedded Products B.V. <Mike Looijmans> (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of datra-utils.
+ * datra-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * datra-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#pragma once
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+/*
+ * Static (USDT) tracepoints. Each one compiles to a single nop plus a
+ * note in the ELF file, so they cost nothing until perf, bpftrace or
+ * systemtap attaches to them. The provider is the tool name, list them
+ * with e.g. "bpftrace -l 'usdt:/usr/bin/datraproxy:*'". Scripts that use
+ * them are in the tracing directory.
+ * Without sys/sdt.h (or with --disable-tracepoints) they vanish, so
+ * arguments must not have side effects.
+ */
+#ifdef HAVE_SYS_SDT_H
+#	include <sys/sdt.h>
+#	define DATRA_PROBE(provider, name) DTRACE_PROBE(provider, name)
+#	define DATRA_PROBE1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#	define DATRA_PROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#	define DATRA_PROBE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#	define DATRA_PROBE(provider, name) do {} while (0)
+#	define DATRA_PROBE1(provider, name, a) do {} while (0)
+#	define DATRA_PROBE2(provider, name, a, b) do {} while (0)
+#	define DATRA_PROBE3(provider, name, a, b, c) do {} while (0)
+#endif